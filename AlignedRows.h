@@ -0,0 +1,128 @@
+#pragma once
+#include <SDL.h>
+#include "BMPHeader.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#define ROW_ALIGN 64 // Cache line size
+
+// The working surface gets a row pitch padded to ROW_ALIGN bytes so that rows owned by different
+// threads never share a cache line. SDL_SaveBMP converts back to the BMP stride when writing
+inline SDL_Surface* createAlignedSurface(int w, int h, int bitsPerPixel, Uint32 format) {
+    size_t pitch = ((size_t)w * (bitsPerPixel / 8) + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+    if (w <= 0 || h <= 0 || pitch > INT_MAX || (size_t)h > SIZE_MAX / pitch) {
+        SDL_SetError("Image dimensions %dx%d are too large", w, h);
+        return NULL;
+    }
+    void* pixels = NULL;
+#ifdef _WIN32
+    pixels = _aligned_malloc(pitch * h, ROW_ALIGN);
+#else
+    if (posix_memalign(&pixels, ROW_ALIGN, pitch * h) != 0) {
+        pixels = NULL;
+    }
+#endif
+    if (!pixels) {
+        SDL_SetError("Unable to allocate working surface");
+        return NULL;
+    }
+    SDL_Surface* aligned = SDL_CreateRGBSurfaceWithFormatFrom(pixels, w, h, bitsPerPixel, (int)pitch, format);
+    if (!aligned) {
+#ifdef _WIN32
+        _aligned_free(pixels);
+#else
+        free(pixels);
+#endif
+        return NULL;
+    }
+    return aligned;
+}
+
+inline void freeAlignedRows(SDL_Surface* image) {
+    void* pixels = image->pixels;
+    SDL_FreeSurface(image);
+#ifdef _WIN32
+    _aligned_free(pixels);
+#else
+    free(pixels);
+#endif
+}
+
+// A padded copy of image, for surfaces SDL has already decoded
+inline SDL_Surface* toAlignedRows(SDL_Surface* image) {
+    SDL_Surface* aligned = createAlignedSurface(image->w, image->h, image->format->BitsPerPixel, image->format->format);
+    if (!aligned) {
+        return NULL;
+    }
+    if (image->format->palette) {
+        SDL_SetSurfacePalette(aligned, image->format->palette);
+    }
+    for (int y = 0; y < image->h; y++) {
+        memcpy((Uint8*)aligned->pixels + (size_t)y * aligned->pitch, (Uint8*)image->pixels + (size_t)y * image->pitch, (size_t)image->w * image->format->BytesPerPixel);
+    }
+    return aligned;
+}
+
+// Uncompressed 8/24/32-bit BMPs are read row by row straight into the padded surface, so only one copy
+// of the pixels is ever in memory. Anything else is decoded by SDL and copied
+inline SDL_Surface* loadAlignedBMP(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        SDL_SetError("Unable to open %s", path);
+        return NULL;
+    }
+    Uint8 data[54];
+    BMPHeader header;
+    long fileSize = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    bool native = fileSize >= 54 && fseek(file, 0, SEEK_SET) == 0 && fread(data, 1, sizeof(data), file) == sizeof(data)
+        && parseBMPHeader(data, fileSize, header) && header.compression == 0 && (header.bpp == 8 || header.bpp == 24 || header.bpp == 32);
+    if (!native) {
+        fclose(file);
+        SDL_Surface* decoded = SDL_LoadBMP(path);
+        if (!decoded) {
+            return NULL;
+        }
+        SDL_Surface* aligned = toAlignedRows(decoded);
+        SDL_FreeSurface(decoded);
+        return aligned;
+    }
+
+    // The file stride (rounded to 4 bytes) never exceeds the padded pitch, so every stored row is read in place
+    int w = header.w, h = header.h, bpp = header.bpp;
+    size_t stride = header.stride;
+    Uint32 format = bpp == 8 ? SDL_PIXELFORMAT_INDEX8 : bpp == 24 ? SDL_PIXELFORMAT_BGR24 : SDL_PIXELFORMAT_RGB888;
+    SDL_Surface* image = createAlignedSurface(w, h, bpp, format);
+    if (!image) {
+        fclose(file);
+        return NULL;
+    }
+    bool ok = true;
+    if (bpp == 8) {
+        int count = header.colors;
+        Uint8 palette[256 * 4];
+        SDL_Color sdlColors[256];
+        ok = fseek(file, 14 + header.headerSize, SEEK_SET) == 0 && fread(palette, 4, count, file) == (size_t)count;
+        for (int i = 0; ok && i < count; i++) {
+            sdlColors[i] = { palette[4 * i + 2], palette[4 * i + 1], palette[4 * i], 255 };
+        }
+        ok = ok && SDL_SetPaletteColors(image->format->palette, sdlColors, 0, count) == 0;
+    }
+    ok = ok && fseek(file, header.dataOffset, SEEK_SET) == 0;
+    for (int stored = 0; ok && stored < h; stored++) {
+        int y = header.bottomUp ? h - 1 - stored : stored;
+        ok = fread((Uint8*)image->pixels + (size_t)y * image->pitch, 1, stride, file) == stride;
+    }
+    fclose(file);
+    if (!ok) {
+        freeAlignedRows(image);
+        SDL_SetError("Unable to read %s", path);
+        return NULL;
+    }
+    return image;
+}
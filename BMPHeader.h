@@ -0,0 +1,67 @@
+#pragma once
+#include <SDL.h>
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+
+// What the file and info headers of a .bmp say, checked against the length of the file. Every loader that
+// reads BMPs itself goes through parseBMPHeader, anything it rejects is left to SDL_LoadBMP
+struct BMPHeader {
+    Uint32 dataOffset;
+    Uint32 headerSize; // Of the info header, the palette follows it
+    int w, h; // h is always positive, bottomUp says in which order the rows are stored
+    bool bottomUp;
+    int bpp;
+    Uint32 compression; // 0 = BI_RGB, 1 = BI_RLE8, 2 = BI_RLE4, 3 = BI_BITFIELDS
+    int colors; // Palette entries, 0 above 8 bits per pixel
+    size_t stride; // Bytes per stored row, rounded up to 4
+    size_t dataSize; // Bytes from dataOffset to the end of the file
+};
+
+inline Uint32 readLE32(const Uint8* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (Uint32)p[3] << 24;
+}
+
+// data holds at least the first 54 bytes of a file of fileSize bytes. The palette and the pixel data have to
+// start inside the file, and an uncompressed image has to have all of its rows there. An RLE stream can skip
+// rows and end early, so for compressed images the caller has to bound what it decodes
+inline bool parseBMPHeader(const Uint8* data, size_t fileSize, BMPHeader& header) {
+    if (fileSize < 54 || data[0] != 'B' || data[1] != 'M') {
+        return false;
+    }
+    header.dataOffset = readLE32(data + 10);
+    header.headerSize = readLE32(data + 14);
+    header.w = (int)readLE32(data + 18);
+    header.h = (int)readLE32(data + 22);
+    header.bpp = data[28] | data[29] << 8;
+    header.compression = readLE32(data + 30);
+    Uint32 colorsUsed = readLE32(data + 46);
+    if (header.headerSize < 40 || header.dataOffset < 14 + (size_t)header.headerSize || header.dataOffset >= fileSize
+        || header.w <= 0 || header.h == 0 || header.h == INT_MIN) {
+        return false;
+    }
+    if (header.bpp != 1 && header.bpp != 4 && header.bpp != 8 && header.bpp != 16 && header.bpp != 24 && header.bpp != 32) {
+        return false;
+    }
+    header.bottomUp = header.h > 0;
+    header.h = header.bottomUp ? header.h : -header.h;
+    header.dataSize = fileSize - header.dataOffset;
+
+    if ((size_t)header.w > (SIZE_MAX - 31) / header.bpp) {
+        return false;
+    }
+    header.stride = ((size_t)header.w * header.bpp + 31) / 32 * 4;
+    bool uncompressed = header.compression == 0 || header.compression == 3;
+    if (uncompressed && (size_t)header.h > header.dataSize / header.stride) {
+        return false;
+    }
+
+    header.colors = 0;
+    if (header.bpp <= 8) {
+        header.colors = colorsUsed == 0 || colorsUsed > (1u << header.bpp) ? 1 << header.bpp : (int)colorsUsed;
+        if (14 + (size_t)header.headerSize + 4 * (size_t)header.colors > header.dataOffset) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,635 @@
+#include <SDL.h>
+#include "AlignedRows.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <queue>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define max std::max
+#define min std::min
+#endif
+
+#define THREADS 12
+#define MAX_WORKERS 12
+#define CONTRAST_FACTOR 128
+
+#define WARMUP 2
+#define SAMPLES 10
+
+// Synthetic inputs: every size is generated in every format
+const int SIZES[][2] = { { 64, 64 }, { 640, 480 }, { 1921, 1081 }, { 4000, 3000 } };
+const int BITS_PER_PIXEL[] = { 8, 24, 32 };
+
+// False sharing check: 24-bit rows of these widths are not a multiple of 64 bytes, except 4096 which is the control
+const int SHARING_WIDTHS[] = { 1001, 1366, 1921, 3001, 4096 };
+#define SHARING_HEIGHT 1024
+
+// --scaling: every kernel runs on 1 .. SCALING_MAX_THREADS threads over a working set far larger than any last level cache
+#define SCALING_MAX_THREADS 0 // 0 = As many as the host has hardware threads
+#define SCALING_BYTES (128 << 20)
+#define SCALING_SLACK 0.1 // The recommended thread count is the smallest that gets within this fraction of the best throughput
+
+void decreaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFactor) {
+    for (int y = startY; y < endY; ++y) {
+        for (int x = 0; x < image->w; ++x) {
+            Uint8* pixel = (Uint8*)image->pixels + y * image->pitch + x * image->format->BytesPerPixel;
+            for (int c = 0; c < image->format->BytesPerPixel; ++c) {
+                pixel[c] = max(0, pixel[c] - contrastFactor);
+            }
+        }
+    }
+}
+
+// Writes an uncompressed bottom-up BMP filled with deterministic noise, 8-bit images get a grayscale palette
+bool writeSyntheticBMP(const std::string& path, int w, int h, int bpp) {
+    int stride = ((w * bpp + 31) / 32) * 4;
+    int paletteSize = bpp == 8 ? 256 * 4 : 0;
+    Uint32 dataOffset = 14 + 40 + paletteSize;
+    Uint32 fileSize = dataOffset + stride * h;
+
+    std::vector<Uint8> file(fileSize, 0);
+    Uint8* p = file.data();
+    auto put16 = [&p](Uint16 v) { p[0] = v & 0xFF; p[1] = v >> 8; p += 2; };
+    auto put32 = [&p](Uint32 v) { for (int i = 0; i < 4; i++) { p[i] = (v >> (8 * i)) & 0xFF; } p += 4; };
+
+    put16(0x4D42); put32(fileSize); put32(0); put32(dataOffset);
+    put32(40); put32(w); put32(h); put16(1); put16(bpp); put32(0); put32(stride * h);
+    put32(2835); put32(2835); put32(bpp == 8 ? 256 : 0); put32(0);
+    for (int i = 0; i < paletteSize / 4; i++) {
+        put32(i * 0x010101);
+    }
+
+    Uint32 state = 0x9E3779B9 ^ (w * 31 + h * 17 + bpp);
+    for (int y = 0; y < h; y++) {
+        Uint8* row = file.data() + dataOffset + y * stride;
+        for (int x = 0; x < w * bpp / 8; x++) {
+            state ^= state << 13; state ^= state >> 17; state ^= state << 5; // xorshift32
+            row[x] = state & 0xFF;
+        }
+    }
+
+    FILE* out = fopen(path.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    bool ok = fwrite(file.data(), 1, file.size(), out) == file.size();
+    fclose(out);
+    return ok;
+}
+
+// Scheduling methods, mirroring Lab2 METHOD 1/2/3 and the Lab3/Lab5 row queue
+
+void runSerial(SDL_Surface* image) {
+    decreaseContrast(image, 0, image->h, CONTRAST_FACTOR);
+}
+
+void runSectors(SDL_Surface* image) {
+    std::vector<std::thread> threads;
+    int everyXth = image->h / THREADS;
+    for (int i = 0; i < THREADS; ++i) {
+        int startY = i * everyXth;
+        int endY = (i == THREADS - 1) ? image->h : (i + 1) * everyXth;
+        threads.emplace_back([startY, endY, image] {
+            decreaseContrast(image, startY, endY, CONTRAST_FACTOR);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void runInterleaved(SDL_Surface* image) {
+    std::vector<std::thread> threads;
+    int everyXth = THREADS;
+    for (int i = 0; i < THREADS; ++i) {
+        int rows = image->h % everyXth > i ? image->h / everyXth + 1 : image->h / everyXth;
+        threads.emplace_back([i, rows, everyXth, image] {
+            for (int j = 0; j < rows; j++) {
+                int row = j * everyXth + i;
+                decreaseContrast(image, row, row + 1, CONTRAST_FACTOR);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void runQueue(SDL_Surface* image) {
+    std::queue<int> rowsToProcess;
+    for (int i = 0; i < image->h; i++) {
+        rowsToProcess.push(i);
+    }
+    int currentlyWorking = 0;
+#ifdef _WIN32
+    HANDLE queueMutex = CreateMutex(NULL, FALSE, NULL);
+#else
+    pthread_mutex_t queueMutex;
+    pthread_mutex_init(&queueMutex, NULL);
+#endif
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREADS; ++i) {
+        threads.emplace_back([&rowsToProcess, image, &queueMutex, &currentlyWorking] {
+            while (true) {
+#ifdef _WIN32
+                WaitForSingleObject(queueMutex, INFINITE);
+#else
+                pthread_mutex_lock(&queueMutex);
+#endif
+                bool empty = rowsToProcess.empty();
+                int row = -1;
+                if (!empty && currentlyWorking < MAX_WORKERS) {
+                    currentlyWorking++;
+                    row = rowsToProcess.front();
+                    rowsToProcess.pop();
+                }
+#ifdef _WIN32
+                ReleaseMutex(queueMutex);
+#else
+                pthread_mutex_unlock(&queueMutex);
+#endif
+                if (empty) {
+                    break;
+                }
+                if (row == -1) {
+                    continue;
+                }
+                decreaseContrast(image, row, row + 1, CONTRAST_FACTOR);
+#ifdef _WIN32
+                WaitForSingleObject(queueMutex, INFINITE);
+#else
+                pthread_mutex_lock(&queueMutex);
+#endif
+                currentlyWorking--;
+#ifdef _WIN32
+                ReleaseMutex(queueMutex);
+#else
+                pthread_mutex_unlock(&queueMutex);
+#endif
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+#ifdef _WIN32
+    CloseHandle(queueMutex);
+#else
+    pthread_mutex_destroy(&queueMutex);
+#endif
+}
+
+// I/O paths: plain SDL, memory mapped (Lab4/Lab5) and streamed in fixed-size chunks
+
+SDL_Surface* loadSDL(const std::string& path) {
+    return SDL_LoadBMP(path.c_str());
+}
+
+SDL_Surface* loadMmap(const std::string& path) {
+#ifdef _WIN32
+    std::wstring wpath(path.begin(), path.end());
+    HANDLE hFile = CreateFile(wpath.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    char* pBuf = hMap ? (char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+    SDL_Surface* image = pBuf ? SDL_LoadBMP_RW(SDL_RWFromMem(pBuf, GetFileSize(hFile, NULL)), 1) : NULL;
+    if (pBuf) {
+        UnmapViewOfFile(pBuf);
+    }
+    if (hMap) {
+        CloseHandle(hMap);
+    }
+    CloseHandle(hFile);
+    return image;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return NULL;
+    }
+    char* file_data = static_cast<char*>(mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (file_data == MAP_FAILED) {
+        return NULL;
+    }
+    SDL_Surface* image = SDL_LoadBMP_RW(SDL_RWFromMem(file_data, sb.st_size), 1);
+    munmap(file_data, sb.st_size);
+    return image;
+#endif
+}
+
+SDL_Surface* loadStream(const std::string& path) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in) {
+        return NULL;
+    }
+    std::vector<char> data;
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(in);
+    return SDL_LoadBMP_RW(SDL_RWFromMem(data.data(), data.size()), 1);
+}
+
+bool saveSDL(SDL_Surface* image, const std::string& path) {
+    return SDL_SaveBMP(image, path.c_str()) == 0;
+}
+
+bool saveMmap(SDL_Surface* image, const std::string& path, long fileSize) {
+    if (fileSize <= 0) {
+        return false;
+    }
+#ifdef _WIN32
+    std::wstring wpath(path.begin(), path.end());
+    HANDLE hFile = CreateFile(wpath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    SetFilePointer(hFile, fileSize, NULL, FILE_BEGIN);
+    SetEndOfFile(hFile);
+    HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+    char* pBuf = hMap ? (char*)MapViewOfFile(hMap, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+    bool ok = pBuf && SDL_SaveBMP_RW(image, SDL_RWFromMem(pBuf, fileSize), 1) == 0;
+    if (pBuf) {
+        UnmapViewOfFile(pBuf);
+    }
+    if (hMap) {
+        CloseHandle(hMap);
+    }
+    CloseHandle(hFile);
+    return ok;
+#else
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        return false;
+    }
+    if (ftruncate(fd, fileSize) == -1) {
+        close(fd);
+        return false;
+    }
+    char* file_data = static_cast<char*>(mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    close(fd);
+    if (file_data == MAP_FAILED) {
+        return false;
+    }
+    bool ok = SDL_SaveBMP_RW(image, SDL_RWFromMem(file_data, fileSize), 1) == 0;
+    ok = msync(file_data, fileSize, MS_SYNC) == 0 && ok;
+    munmap(file_data, fileSize);
+    return ok;
+#endif
+}
+
+long fileSizeOf(const std::string& path) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in) {
+        return -1;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fclose(in);
+    return size;
+}
+
+struct Result {
+    std::string name;
+    int bpp;
+    int w, h;
+    long long bytes;
+    std::vector<double> samples; // microseconds
+};
+
+double percentile(std::vector<double> samples, double p) {
+    std::sort(samples.begin(), samples.end());
+    size_t index = (size_t)(p * (samples.size() - 1) + 0.5);
+    return samples[index];
+}
+
+// Runs setup() + body() WARMUP + SAMPLES times, only body() is timed
+Result measure(const std::string& name, int bpp, int w, int h, long long bytes,
+               const std::function<void()>& setup, const std::function<void()>& body) {
+    Result result{ name, bpp, w, h, bytes, {} };
+    for (int i = 0; i < WARMUP + SAMPLES; i++) {
+        setup();
+        auto startTime = std::chrono::high_resolution_clock::now();
+        body();
+        auto endTime = std::chrono::high_resolution_clock::now();
+        if (i >= WARMUP) {
+            result.samples.push_back(std::chrono::duration<double, std::micro>(endTime - startTime).count());
+        }
+    }
+    return result;
+}
+
+void writeReport(const std::vector<Result>& results, const std::string& path, bool json) {
+    std::ostringstream out;
+    if (json) {
+        out << "[\n";
+    } else {
+        out << "case,bpp,width,height,bytes,samples,median_us,p95_us,mb_per_s\n";
+    }
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        double median = percentile(r.samples, 0.5);
+        double p95 = percentile(r.samples, 0.95);
+        double mbps = median > 0 ? r.bytes / median : 0; // bytes per microsecond == MB/s
+        if (json) {
+            out << "  {\"case\": \"" << r.name << "\", \"bpp\": " << r.bpp << ", \"width\": " << r.w
+                << ", \"height\": " << r.h << ", \"bytes\": " << r.bytes << ", \"samples\": " << r.samples.size()
+                << ", \"median_us\": " << median << ", \"p95_us\": " << p95 << ", \"mb_per_s\": " << mbps << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        } else {
+            out << r.name << "," << r.bpp << "," << r.w << "," << r.h << "," << r.bytes << "," << r.samples.size()
+                << "," << median << "," << p95 << "," << mbps << "\n";
+        }
+        printf("%-20s %2d bpp %5dx%-5d median %10.1f us  p95 %10.1f us  %8.1f MB/s\n",
+               r.name.c_str(), r.bpp, r.w, r.h, median, p95, mbps);
+    }
+    if (json) {
+        out << "]\n";
+    }
+
+    std::ofstream file(path);
+    file << out.str();
+}
+
+// Splits count rows into threads contiguous bands and runs fn(startRow, endRow) for each on its own thread
+void runBands(int count, int threads, const std::function<void(int, int)>& fn) {
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back([i, count, threads, &fn] {
+            fn((int)((long long)count * i / threads), (int)((long long)count * (i + 1) / threads));
+        });
+    }
+    fn(0, count / threads);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// 2x2 box filter for 4-byte pixels, the scalar path of the Lab5 pyramid
+void downscaleRows32(SDL_Surface* src, SDL_Surface* dst, int startY, int endY) {
+    for (int y = startY; y < endY; y++) {
+        const Uint8* a = (const Uint8*)src->pixels + (size_t)(2 * y) * src->pitch;
+        const Uint8* b = a + src->pitch;
+        Uint8* out = (Uint8*)dst->pixels + (size_t)y * dst->pitch;
+        for (int x = 0; x < dst->w; x++) {
+            for (int c = 0; c < 4; c++) {
+                out[4 * x + c] = (a[8 * x + c] + a[8 * x + 4 + c] + b[8 * x + c] + b[8 * x + 4 + c] + 2) >> 2;
+            }
+        }
+    }
+}
+
+struct ScalingPoint {
+    std::string kernel;
+    int threads;
+    double gbPerS;
+};
+
+// Once the threads together saturate memory bandwidth, more of them only add contention. The ceiling is
+// measured the way STREAM's copy does (one read and one write per byte, all threads on disjoint bands)
+// and every kernel is reported against it. Bytes moved: contrast reads and writes the image, the filter
+// reads it and writes a quarter of it
+int scalingReport(const std::string& reportPath) {
+    int maxThreads = SCALING_MAX_THREADS > 0 ? SCALING_MAX_THREADS : max(1, (int)std::thread::hardware_concurrency());
+    int w = 4096, h = SCALING_BYTES / (4 * w);
+    SDL_Surface* original = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGB888);
+    SDL_Surface* image = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGB888);
+    SDL_Surface* half = SDL_CreateRGBSurfaceWithFormat(0, w / 2, h / 2, 32, SDL_PIXELFORMAT_RGB888);
+    if (!original || !image || !half) {
+        std::cerr << "Error: Unable to allocate " << 2 * (SCALING_BYTES >> 20) << " MB of surfaces - " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    long long bytes = (long long)original->pitch * h;
+    Uint32 state = 0x9E3779B9;
+    for (long long i = 0; i < bytes / 4; i++) {
+        state ^= state << 13; state ^= state >> 17; state ^= state << 5; // xorshift32
+        ((Uint32*)original->pixels)[i] = state;
+    }
+    memcpy(image->pixels, original->pixels, bytes);
+    memset(half->pixels, 0, (size_t)half->pitch * half->h);
+
+    std::vector<ScalingPoint> points;
+    for (int threads = 1; threads <= maxThreads; threads++) {
+        std::vector<Result> results;
+        results.push_back(measure("copy", 32, w, h, 2 * bytes, [] {}, [&] {
+            runBands(h, threads, [&](int startY, int endY) {
+                memcpy((Uint8*)image->pixels + (size_t)startY * image->pitch, (Uint8*)original->pixels + (size_t)startY * original->pitch, (size_t)(endY - startY) * original->pitch);
+            });
+        }));
+        results.push_back(measure("contrast", 32, w, h, 2 * bytes,
+            [&] { memcpy(image->pixels, original->pixels, bytes); },
+            [&] { runBands(h, threads, [&](int startY, int endY) { decreaseContrast(image, startY, endY, CONTRAST_FACTOR); }); }));
+        results.push_back(measure("filter", 32, w, h, bytes + (long long)half->pitch * half->h, [] {}, [&] {
+            runBands(half->h, threads, [&](int startY, int endY) { downscaleRows32(original, half, startY, endY); });
+        }));
+        for (const Result& r : results) {
+            points.push_back({ r.name, threads, r.bytes / percentile(r.samples, 0.5) / 1e3 }); // bytes per microsecond / 1000 == GB/s
+        }
+    }
+    SDL_FreeSurface(half);
+    SDL_FreeSurface(image);
+    SDL_FreeSurface(original);
+
+    auto best = [&points](const std::string& kernel) {
+        ScalingPoint top{ kernel, 0, 0 };
+        for (const ScalingPoint& p : points) {
+            if (p.kernel == kernel && p.gbPerS > top.gbPerS) {
+                top = p;
+            }
+        }
+        return top;
+    };
+    double roofline = best("copy").gbPerS;
+
+    std::ofstream file(reportPath);
+    file << "kernel,threads,gb_per_s,roofline_fraction\n";
+    printf("%7s %10s %10s %7s %10s %7s\n", "threads", "copy GB/s", "contrast", "roof", "filter", "roof");
+    for (size_t i = 0; i < points.size(); i += 3) {
+        printf("%7d %10.2f %10.2f %6.0f%% %10.2f %6.0f%%\n", points[i].threads, points[i].gbPerS,
+               points[i + 1].gbPerS, 100 * points[i + 1].gbPerS / roofline, points[i + 2].gbPerS, 100 * points[i + 2].gbPerS / roofline);
+        for (size_t j = i; j < i + 3; j++) {
+            file << points[j].kernel << "," << points[j].threads << "," << points[j].gbPerS << "," << points[j].gbPerS / roofline << "\n";
+        }
+    }
+    printf("\nCopy roofline %.2f GB/s at %d threads\n", roofline, best("copy").threads);
+
+    // Past the first thread count within SCALING_SLACK of a kernel's best, extra threads buy less than the slack
+    int recommended = 1;
+    for (const char* kernel : { "contrast", "filter" }) {
+        ScalingPoint top = best(kernel);
+        int enough = top.threads;
+        for (const ScalingPoint& p : points) {
+            if (p.kernel == kernel && p.gbPerS >= (1 - SCALING_SLACK) * top.gbPerS) {
+                enough = min(enough, p.threads);
+            }
+        }
+        printf("%-8s best %.2f GB/s (%.0f%% of roofline, %s) at %d threads, within %.0f%% of that from %d threads\n", kernel,
+               top.gbPerS, 100 * top.gbPerS / roofline, top.gbPerS >= (1 - SCALING_SLACK) * roofline ? "memory bound" : "compute bound",
+               top.threads, 100 * SCALING_SLACK, enough);
+        recommended = max(recommended, enough);
+    }
+    printf("Recommended THREADS: %d\n", recommended);
+    std::cout << "Results written to " << reportPath << std::endl;
+    return 0;
+}
+
+// Usage: Benchmark [output.csv|output.json]
+//        Benchmark --scaling [scaling.csv] - kernel throughput on 1 .. N threads against the host's copy bandwidth
+int main(int argc, char* argv[]) {
+    std::string reportPath = argc > 1 ? argv[1] : "benchmark.csv";
+    bool json = reportPath.size() >= 5 && reportPath.compare(reportPath.size() - 5, 5, ".json") == 0;
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
+        return -1;
+    }
+    if (argc > 1 && strcmp(argv[1], "--scaling") == 0) {
+        int result = scalingReport(argc > 2 ? argv[2] : "scaling.csv");
+        SDL_Quit();
+        return result;
+    }
+
+    const std::vector<std::pair<std::string, void (*)(SDL_Surface*)>> methods = {
+        { "kernel/serial", runSerial },
+        { "kernel/sectors", runSectors },
+        { "kernel/interleaved", runInterleaved },
+        { "kernel/queue", runQueue },
+    };
+    const std::vector<std::pair<std::string, SDL_Surface* (*)(const std::string&)>> loaders = {
+        { "load/sdl", loadSDL },
+        { "load/mmap", loadMmap },
+        { "load/stream", loadStream },
+    };
+
+    std::vector<Result> results;
+    for (const auto& size : SIZES) {
+        for (int bpp : BITS_PER_PIXEL) {
+            int w = size[0], h = size[1];
+            std::string input = "bench_" + std::to_string(w) + "x" + std::to_string(h) + "_" + std::to_string(bpp) + ".bmp";
+            if (!writeSyntheticBMP(input, w, h, bpp)) {
+                std::cerr << "Error: Unable to write " << input << std::endl;
+                continue;
+            }
+            long fileSize = fileSizeOf(input);
+
+            SDL_Surface* original = SDL_LoadBMP(input.c_str());
+            if (!original) {
+                std::cerr << "Error: Unable to load image - " << SDL_GetError() << std::endl;
+                remove(input.c_str());
+                continue;
+            }
+            long long pixelBytes = (long long)original->w * original->h * original->format->BytesPerPixel;
+
+            bool loaded = true;
+            for (const auto& loader : loaders) {
+                results.push_back(measure(loader.first, bpp, w, h, fileSize, [] {}, [&] {
+                    SDL_Surface* image = loader.second(input);
+                    if (image) {
+                        SDL_FreeSurface(image);
+                    } else {
+                        loaded = false;
+                    }
+                }));
+            }
+
+            // Every sample starts from a pristine copy so the kernel does the same work each time
+            SDL_Surface* image = loaded ? SDL_LoadBMP(input.c_str()) : NULL;
+            if (!image) {
+                std::cerr << "Error: Unable to load " << input << " - " << SDL_GetError() << std::endl;
+                SDL_FreeSurface(original);
+                remove(input.c_str());
+                SDL_Quit();
+                return 1;
+            }
+            for (const auto& method : methods) {
+                results.push_back(measure(method.first, bpp, w, h, pixelBytes,
+                    [&] { memcpy(image->pixels, original->pixels, (size_t)original->pitch * original->h); },
+                    [&] { method.second(image); }));
+            }
+
+            // SDL may write a larger header than the input had, so the mapping is sized from what it saved
+            std::string output = "bench_output.bmp";
+            bool saved = saveSDL(image, output);
+            long outputSize = saved ? fileSizeOf(output) : -1;
+            results.push_back(measure("save/sdl", bpp, w, h, fileSize, [] {}, [&] { saved = saveSDL(image, output) && saved; }));
+            results.push_back(measure("save/mmap", bpp, w, h, fileSize, [] {}, [&] { saved = saveMmap(image, output, outputSize) && saved; }));
+            remove(output.c_str());
+
+            SDL_FreeSurface(image);
+            SDL_FreeSurface(original);
+            remove(input.c_str());
+            if (!saved) {
+                std::cerr << "Error: Unable to save " << output << " - " << SDL_GetError() << std::endl;
+                SDL_Quit();
+                return 1;
+            }
+        }
+    }
+
+    // Interleaved rows on the packed BMP stride versus the cache-line padded working layout
+    for (int w : SHARING_WIDTHS) {
+        std::string input = "bench_sharing_" + std::to_string(w) + ".bmp";
+        if (!writeSyntheticBMP(input, w, SHARING_HEIGHT, 24)) {
+            std::cerr << "Error: Unable to write " << input << std::endl;
+            continue;
+        }
+        SDL_Surface* packed = SDL_LoadBMP(input.c_str());
+        remove(input.c_str());
+        if (!packed) {
+            std::cerr << "Error: Unable to load image - " << SDL_GetError() << std::endl;
+            continue;
+        }
+        SDL_Surface* original = toAlignedRows(packed);
+        SDL_Surface* padded = toAlignedRows(packed);
+        long long pixelBytes = (long long)w * SHARING_HEIGHT * 3;
+
+        results.push_back(measure("sharing/packed", 24, w, SHARING_HEIGHT, pixelBytes,
+            [&] {
+                for (int y = 0; y < packed->h; y++) {
+                    memcpy((Uint8*)packed->pixels + (size_t)y * packed->pitch, (Uint8*)original->pixels + (size_t)y * original->pitch, (size_t)w * 3);
+                }
+            },
+            [&] { runInterleaved(packed); }));
+        results.push_back(measure("sharing/padded", 24, w, SHARING_HEIGHT, pixelBytes,
+            [&] { memcpy(padded->pixels, original->pixels, (size_t)original->pitch * original->h); },
+            [&] { runInterleaved(padded); }));
+
+        freeAlignedRows(padded);
+        freeAlignedRows(original);
+        SDL_FreeSurface(packed);
+    }
+
+    writeReport(results, reportPath, json);
+    std::cout << "Results written to " << reportPath << std::endl;
+
+    SDL_Quit();
+    return 0;
+}
@@ -1,19 +1,66 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <map>
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 
 #ifdef _WIN32
 #include <Windows.h>
 #else
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <unistd.h>
+#include <fcntl.h>
 #include <boost/process.hpp>
+#include <boost/process/extend.hpp>
+#include <csignal>
+#include <functional>
+#include <boost/asio/steady_timer.hpp>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 namespace bp = boost::process;
 #endif
 namespace fs = std::filesystem;
 
+#define FETCH_TIMEOUT_MS 60000 // A fetch still running after this long is stopped and the repository is skipped
+#define FETCH_KILL_GRACE_MS 2000 // Time git gets to exit after SIGTERM before it is SIGKILLed
+#define INTERRUPT_POLL_MS 50 // How often a running git checks whether Ctrl-C has arrived
+#define PROBE 1 // 1 = Compare the tips of the tracked branches with ls-remote first and fetch only repositories where they moved
+#define FETCH_TRACKED_ONLY 0 // 1 = A repository found changed by the probe fetches only its tracked branches, not everything from origin
+
+#define GOVERNOR 0 // 1 = Check several repositories at once, as many as load average and pressure stall information allow (Linux only)
+#define GOVERNOR_MAX_FETCHES 8
+#define GOVERNOR_INTERVAL_MS 500 // How often load is sampled and the limit adjusted
+#define GOVERNOR_PSI_HIGH 10.0 // I/O or CPU "some avg10" pressure (%) above which the limit is halved
+#define GOVERNOR_PSI_LOW 2.0 // Below this, and with the load average under the CPU count, one more fetch is allowed
+#define FETCH_IO_CLASS 3 // I/O scheduling class of governed git children: 3 = idle, 2 = best-effort at FETCH_IO_LEVEL, 0 = inherited
+#define FETCH_IO_LEVEL 7 // Best-effort level, 0 (highest) .. 7 (lowest)
+#define FETCH_CGROUP "" // Non-empty = cgroup v2 directory governed git children are started in, e.g. "/sys/fs/cgroup/lab1-fetch"
+#define FETCH_IO_WEIGHT 10 // io.weight of FETCH_CGROUP, 1 .. 10000 (default 100)
+#define FETCH_CPU_WEIGHT 10 // cpu.weight of FETCH_CGROUP, 1 .. 10000 (default 100)
+
+#define BENCH_REPOS 8 // Repositories scanned per mode by --benchmark
+#define BENCH_CHANGED 2 // Of those, origins that get new commits on the tracked branch and on an untracked one
+#define BENCH_COMMITS 2000 // History of every origin
+#define BENCH_NEW_COMMITS 100 // Added to each changed branch
+#define BENCH_BLOB_BYTES 4096 // Every commit rewrites one file of this size
+#define BENCH_TAG_EVERY 10 // A tag every N commits of the initial history, they are all part of a full ref advertisement
+#define BENCH_PROBE_INTERVAL_MS 10 // Foreground latency probe of --governor-benchmark: a 4 KB write + fdatasync this often
+
+enum ScanMode {
+    FULL_FETCH, // git fetch every repository and look for "up to date" in the output
+    PROBE_FETCH, // ls-remote the tracked branches, git fetch origin where they differ
+    PROBE_FETCH_TRACKED, // ls-remote the tracked branches, fetch only those branches where they differ
+};
+
 // Function to handle Ctrl-C
 #ifdef _WIN32
 HANDLE gitProcessId = NULL;
@@ -28,27 +75,44 @@ bool CtrlCHandler(DWORD ctrlType) {
     return true;
 }
 #else
-#include <sys/wait.h>
+std::atomic<bool> interrupted(false); // Ctrl-C or SIGTERM arrived, the running git is stopped and no further repositories are checked
+
+// Installed for the whole scan, so a Ctrl-C between two fetches also ends with the partial results
+void OnInterrupt(int) {
+    interrupted = true;
+}
 
-pid_t gitProcessId = -1;
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
 
-bool CtrlCHandler(int sig) {
-    if (sig == SIGINT) {
-        if (gitProcessId != -1) {
-            // Terminate the git process if it's running
-            kill(gitProcessId, SIGKILL); // or SIGTERM if we know it's really git, it handles SIGTERM better
-            waitpid(gitProcessId, NULL, 0);
-        }
+// Set for governed scans only, picked up by every git child before exec
+int fetchIoPriority = 0;
+int fetchCgroupProcs = -1;
+
+// Runs in the forked child right before exec, so only plain system calls here. Nothing is left running
+// at normal priority for even a moment, and helpers git spawns inherit all of it
+void SetupFetchChild() {
+    setpriority(PRIO_PROCESS, 0, 19);
+    if (fetchIoPriority != 0) {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, fetchIoPriority);
+    }
+    if (fetchCgroupProcs != -1) {
+        ssize_t written = write(fetchCgroupProcs, "0", 1); // "0" = the writing process
+        (void)written;
     }
-    return true;
 }
 #endif
 
-// Function to run a command and capture its output (stdout and stderr)
-std::string RunCommand(const std::string& command) {
+// Function to run git with the given arguments in dir and capture its output (stdout, then stderr on Linux)
+// Throws std::runtime_error when git fails, times out or is interrupted
+std::string RunCommand(const fs::path& dir, const std::vector<std::string>& args) {
     std::string result;
 
 #ifdef _WIN32
+    std::string command = "git"; // May want to use global path to make sure it's really git, also check write permissions to make sure user can't edit a file that may be executed by this script as root
+    for (const std::string& arg : args) {
+        command += " " + arg;
+    }
     SECURITY_ATTRIBUTES saAttr;
     saAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
     saAttr.bInheritHandle = TRUE;
@@ -67,7 +131,7 @@ std::string RunCommand(const std::string& command) {
     si.dwFlags |= STARTF_USESTDHANDLES;
 
     std::wstring wcommand(command.begin(), command.end());
-    if (!CreateProcessW(NULL, const_cast<LPWSTR>(wcommand.c_str()), NULL, NULL, TRUE, NORMAL_PRIORITY_CLASS, NULL, NULL, &si, &pi)) { // Use CreateProcessW
+    if (!CreateProcessW(NULL, const_cast<LPWSTR>(wcommand.c_str()), NULL, NULL, TRUE, NORMAL_PRIORITY_CLASS, NULL, dir.wstring().c_str(), &si, &pi)) { // Use CreateProcessW
         throw std::runtime_error("CreateProcess() failed!");
     }
 
@@ -84,57 +148,511 @@ std::string RunCommand(const std::string& command) {
 
     CloseHandle(hReadPipe);
     WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD status = 0;
+    GetExitCodeProcess(pi.hProcess, &status);
     CloseHandle(pi.hProcess);
     CloseHandle(pi.hThread);
+    if (status != 0) {
+        throw std::runtime_error(command + " failed with status " + std::to_string(status));
+    }
 
 #else
     boost::asio::io_context ios;
-    std::vector<char> buffer(4096);
-    bp::child gitProcess(bp::search_path("git"), "fetch", "origin", "--verbose", bp::std_err > boost::asio::buffer(buffer), ios);
-    gitProcessId = gitProcess.id();
-    // Set priority
-    setpriority(PRIO_PROCESS, gitProcessId, 19);
+    std::future<std::string> out, err;
+    boost::asio::steady_timer interruptPoll(ios);
+    boost::asio::steady_timer deadline(ios, std::chrono::milliseconds(FETCH_TIMEOUT_MS));
+    boost::asio::steady_timer escalation(ios);
+    bool exited = false;
+    const char* stopReason = NULL;
+
+    // git gets its own process group, so the helpers it spawns (git-remote-https, ...) are stopped with it
+    // and a Ctrl-C from the terminal reaches only us
+    bp::group gitGroup;
+    bp::child gitProcess(bp::search_path("git"), bp::args(args), bp::start_dir = dir.string(), bp::std_out > out, bp::std_err > err, gitGroup, ios,
+        bp::extend::on_exec_setup = [](auto&) { SetupFetchChild(); }, // Set priority
+        bp::on_exit = [&](int, const std::error_code&) {
+            exited = true;
+            interruptPoll.cancel();
+            deadline.cancel();
+            escalation.cancel();
+        });
+
+    // Runs on the io_context, not in a signal handler: SIGTERM first, SIGKILL if git is still there after the grace period
+    auto stop = [&](const char* reason) {
+        if (exited || stopReason) {
+            return;
+        }
+        stopReason = reason;
+        kill(-gitGroup.native_handle(), SIGTERM);
+        escalation.expires_after(std::chrono::milliseconds(FETCH_KILL_GRACE_MS));
+        escalation.async_wait([&](const boost::system::error_code& error) {
+            if (!error && !exited) {
+                kill(-gitGroup.native_handle(), SIGKILL);
+            }
+        });
+    };
+    // The flag is set by OnInterrupt, a handler of our own (unlike an asio signal_set) stays in place between commands
+    std::function<void(const boost::system::error_code&)> pollInterrupted = [&](const boost::system::error_code& error) {
+        if (error || exited) {
+            return;
+        }
+        if (interrupted) {
+            stop("interrupted");
+            return;
+        }
+        interruptPoll.expires_after(std::chrono::milliseconds(INTERRUPT_POLL_MS));
+        interruptPoll.async_wait(pollInterrupted);
+    };
+    pollInterrupted({});
+    deadline.async_wait([&](const boost::system::error_code& error) {
+        if (!error) {
+            stop("timed out");
+        }
+    });
+
     ios.run();
     gitProcess.wait();
+    if (stopReason) {
+        throw std::runtime_error("git " + args[0] + " " + stopReason);
+    }
+    result = out.get() + err.get();
     int status = gitProcess.exit_code();
     if (status != 0) {
-        std::cerr << "Command failed with status: " << status << std::endl;
+        throw std::runtime_error("git " + args[0] + " failed with status " + std::to_string(status) + ": " + result.substr(0, result.find('\n')));
     }
-    result = std::string(buffer.begin(), buffer.end());
 #endif
 
     return result;
 }
 
+// Parses "<object id>\t<ref>" lines as printed by ls-remote and for-each-ref into ref -> object id
+std::map<std::string, std::string> ParseRefs(const std::string& output) {
+    std::map<std::string, std::string> refs;
+    size_t start = 0;
+    while (start < output.size()) {
+        size_t end = output.find('\n', start);
+        if (end == std::string::npos) {
+            end = output.size();
+        }
+        std::string line = output.substr(start, end - start);
+        size_t tab = line.find('\t');
+        if ((tab == 40 || tab == 64) && line.find_first_not_of("0123456789abcdef") == tab) {
+            refs[line.substr(tab + 1)] = line.substr(0, tab);
+        }
+        start = end + 1;
+    }
+    return refs;
+}
+
+// Branches on origin that some local branch tracks, as refs/heads/... on the remote.
+// Assumes the default refspec, refs/heads/<name> is fetched into refs/remotes/origin/<name>
+std::vector<std::string> TrackedBranches(const fs::path& repoPath) {
+    std::string output = RunCommand(repoPath, { "for-each-ref", "--format=%(upstream)", "refs/heads" });
+    std::vector<std::string> branches;
+    const std::string prefix = "refs/remotes/origin/";
+    size_t start = 0;
+    while (start < output.size()) {
+        size_t end = output.find('\n', start);
+        if (end == std::string::npos) {
+            end = output.size();
+        }
+        std::string upstream = output.substr(start, end - start);
+        if (upstream.compare(0, prefix.size(), prefix) == 0) {
+            std::string branch = "refs/heads/" + upstream.substr(prefix.size());
+            if (std::find(branches.begin(), branches.end(), branch) == branches.end()) {
+                branches.push_back(branch);
+            }
+        }
+        start = end + 1;
+    }
+    return branches;
+}
+
+std::string TrackingRef(const std::string& branch) {
+    return "refs/remotes/origin/" + branch.substr(sizeof("refs/heads/") - 1);
+}
+
+// Asks origin only for the advertised tips of the tracked branches (every branch when none is tracked) and compares them
+// with the remote-tracking refs. No objects are transferred
+bool RemoteTipsDiffer(const fs::path& repoPath, const std::vector<std::string>& branches) {
+    std::vector<std::string> args = { "ls-remote", "--heads", "origin" };
+    args.insert(args.end(), branches.begin(), branches.end());
+    std::map<std::string, std::string> remote = ParseRefs(RunCommand(repoPath, args));
+    std::map<std::string, std::string> local = ParseRefs(RunCommand(repoPath, { "for-each-ref", "--format=%(objectname)%09%(refname)", "refs/remotes/origin" }));
+
+    for (const auto& tip : remote) {
+        auto tracking = local.find(TrackingRef(tip.first));
+        if (tracking == local.end() || tracking->second != tip.second) {
+            return true;
+        }
+    }
+    // A tracked branch that was deleted on origin is a change too
+    for (const std::string& branch : branches) {
+        if (!remote.count(branch) && local.count(TrackingRef(branch))) {
+            return true;
+        }
+    }
+    return false;
+}
+
 // Function to check if a Git repository is updated
-bool IsGitRepositoryUpdated(const fs::path& repoPath) {
-    fs::current_path(repoPath);
-    std::string command = "git fetch --verbose origin"; // May want to use global path to make sure it's really git, also check write permissions to make sure user can't edit a file that may be executed by this script as root
-    std::string output = RunCommand(command);
-    // Check if the output contains "up to date"
-    return output.find("up to date") == std::string::npos;
+bool IsGitRepositoryUpdated(const fs::path& repoPath, ScanMode mode) {
+    if (mode == FULL_FETCH) {
+        std::string output = RunCommand(repoPath, { "fetch", "--verbose", "origin" });
+        // Check if the output contains "up to date"
+        return output.find("up to date") == std::string::npos;
+    }
+
+    std::vector<std::string> branches = TrackedBranches(repoPath);
+    if (!RemoteTipsDiffer(repoPath, branches)) {
+        return false;
+    }
+    std::vector<std::string> args = { "fetch", "--verbose", "origin" };
+    if (mode == PROBE_FETCH_TRACKED) {
+        for (const std::string& branch : branches) {
+            args.push_back("+" + branch + ":" + TrackingRef(branch));
+        }
+    }
+    RunCommand(repoPath, args);
+    return true;
 }
 
-int main() {
-    // Set Ctrl-C handler
-#ifdef _WIN32
-    SetConsoleCtrlHandler((PHANDLER_ROUTINE)CtrlCHandler, TRUE);
-#else
-    signal(SIGINT, reinterpret_cast<__sighandler_t>(CtrlCHandler));
-#endif
+#ifndef _WIN32
+// "some avg10" of /proc/pressure/<resource>: share of the last 10 s in which at least one task stalled on it, -1 without PSI
+double ReadPressure(const char* resource) {
+    std::string path = std::string("/proc/pressure/") + resource;
+    FILE* file = fopen(path.c_str(), "r");
+    double avg10 = -1;
+    if (file) {
+        if (fscanf(file, "some avg10=%lf", &avg10) != 1) {
+            avg10 = -1;
+        }
+        fclose(file);
+    }
+    return avg10;
+}
 
-    std::vector<fs::path> updatedRepositories;
+// Halves the limit when the machine is under pressure, adds one fetch when it is clearly idle
+int GovernorLimit(int limit) {
+    double load = 0;
+    getloadavg(&load, 1);
+    double pressure = std::max(ReadPressure("io"), ReadPressure("cpu"));
+    double cpus = std::max(1u, std::thread::hardware_concurrency());
+    if (pressure > GOVERNOR_PSI_HIGH || load > cpus) {
+        return std::max(1, limit / 2);
+    }
+    if (pressure < GOVERNOR_PSI_LOW && load < cpus) {
+        return std::min(GOVERNOR_MAX_FETCHES, limit + 1);
+    }
+    return limit;
+}
 
-    // Get the current directory
-    fs::path currentDir = fs::current_path();
+// Creates FETCH_CGROUP with low io and cpu weights and opens its cgroup.procs for the children to join, -1 if unavailable
+int OpenFetchCgroup() {
+    std::string cgroup = FETCH_CGROUP;
+    if (cgroup.empty()) {
+        return -1;
+    }
+    mkdir(cgroup.c_str(), 0755);
+    const std::pair<const char*, std::string> weights[] = {
+        { "/io.weight", "default " + std::to_string(FETCH_IO_WEIGHT) },
+        { "/cpu.weight", std::to_string(FETCH_CPU_WEIGHT) },
+    };
+    for (const auto& weight : weights) {
+        // Needs the controller enabled in the parent's cgroup.subtree_control, io.weight also an I/O scheduler that honours it
+        FILE* file = fopen((cgroup + weight.first).c_str(), "w");
+        if (!file || fputs(weight.second.c_str(), file) < 0 || fclose(file) != 0) {
+            std::cerr << "Warning: Unable to set " << cgroup << weight.first << std::endl;
+        }
+    }
+    int procs = open((cgroup + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    if (procs == -1) {
+        std::cerr << "Warning: Unable to use cgroup " << cgroup << std::endl;
+    }
+    return procs;
+}
+
+int governorPeak = 0; // Most fetches that were in flight at once during the last governed scan
+#endif
 
+std::vector<fs::path> FindUpdatedRepositories(const fs::path& currentDir, ScanMode mode, bool governed) {
+    std::vector<fs::path> repositories;
     for (const fs::path& entry : fs::directory_iterator(currentDir)) {
         if (fs::is_directory(entry) && fs::exists(entry / ".git")) {
-            if (IsGitRepositoryUpdated(entry)) {
+            repositories.push_back(entry);
+        }
+    }
+    std::sort(repositories.begin(), repositories.end());
+
+    std::vector<fs::path> updatedRepositories;
+    std::mutex mutex;
+    auto check = [&updatedRepositories, &mutex, mode](const fs::path& entry) {
+        try {
+            if (IsGitRepositoryUpdated(entry, mode)) {
+                std::lock_guard<std::mutex> lock(mutex);
                 updatedRepositories.push_back(entry);
             }
+        } catch (const std::runtime_error& error) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::cerr << entry << ": " << error.what() << std::endl;
         }
+    };
+
+#ifndef _WIN32
+    if (governed) {
+        fetchIoPriority = FETCH_IO_CLASS == 0 ? 0 : FETCH_IO_CLASS << IOPRIO_CLASS_SHIFT | (FETCH_IO_CLASS == 2 ? FETCH_IO_LEVEL : 0);
+        fetchCgroupProcs = OpenFetchCgroup();
+        governorPeak = 0;
+
+        std::condition_variable finished;
+        std::vector<std::thread> fetches;
+        int running = 0, limit = 1;
+        auto sampled = std::chrono::steady_clock::now() - std::chrono::milliseconds(GOVERNOR_INTERVAL_MS);
+        for (size_t next = 0; next < repositories.size() && !interrupted;) {
+            // Only this thread touches limit, so /proc is read without holding up finishing fetches
+            if (std::chrono::steady_clock::now() - sampled >= std::chrono::milliseconds(GOVERNOR_INTERVAL_MS)) {
+                limit = GovernorLimit(limit);
+                sampled = std::chrono::steady_clock::now();
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            if (running >= limit) {
+                finished.wait_for(lock, std::chrono::milliseconds(GOVERNOR_INTERVAL_MS));
+                continue;
+            }
+            running++;
+            governorPeak = std::max(governorPeak, running);
+            lock.unlock();
+            fetches.emplace_back([&check, &mutex, &finished, &running, entry = repositories[next++]] {
+                check(entry);
+                std::lock_guard<std::mutex> lock(mutex);
+                running--;
+                finished.notify_one();
+            });
+        }
+        for (auto& fetch : fetches) {
+            fetch.join();
+        }
+
+        if (fetchCgroupProcs != -1) {
+            close(fetchCgroupProcs);
+        }
+        fetchIoPriority = 0;
+        fetchCgroupProcs = -1;
+        std::sort(updatedRepositories.begin(), updatedRepositories.end());
+        return updatedRepositories;
     }
+#endif
+    for (const fs::path& entry : repositories) {
+        check(entry);
+#ifndef _WIN32
+        if (interrupted) {
+            break;
+        }
+#endif
+    }
+    return updatedRepositories;
+}
+
+#ifndef _WIN32
+// Runs git in dir for the benchmark setup, stdin comes from input when given
+void BenchmarkGit(const fs::path& dir, const std::vector<std::string>& args, const std::string& input = "") {
+    int status = input.empty()
+        ? bp::system(bp::search_path("git"), bp::args(args), bp::start_dir = dir.string(), bp::std_out > bp::null)
+        : bp::system(bp::search_path("git"), bp::args(args), bp::start_dir = dir.string(), bp::std_out > bp::null, bp::std_in < input);
+    if (status != 0) {
+        throw std::runtime_error("Benchmark setup: git " + args[0] + " failed in " + dir.string());
+    }
+}
+
+// Appends count commits on branch to a git fast-import stream, continuing from the branch's current tip when continueBranch is set.
+// Every commit rewrites one of 64 files with pseudo-random hex text, so the history is big and compresses poorly
+void WriteHistory(FILE* stream, const std::string& branch, int firstMark, int count, bool continueBranch, bool tags, unsigned& seed) {
+    std::string blob(BENCH_BLOB_BYTES, ' ');
+    for (int mark = firstMark; mark < firstMark + count; mark++) {
+        for (size_t i = 0; i < blob.size(); i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            blob[i] = i % 64 == 63 ? '\n' : "0123456789abcdef"[seed & 15];
+        }
+        std::string message = "Commit " + std::to_string(mark);
+        fprintf(stream, "commit %s\nmark :%d\ncommitter Benchmark <benchmark@example.com> %d +0000\ndata %zu\n%s\n",
+                branch.c_str(), mark, 1700000000 + mark, message.size(), message.c_str());
+        if (mark > firstMark) {
+            fprintf(stream, "from :%d\n", mark - 1);
+        } else if (continueBranch) {
+            fprintf(stream, "from %s^0\n", branch.c_str());
+        }
+        fprintf(stream, "M 644 inline data/%d.txt\ndata %zu\n", mark % 64, blob.size());
+        fwrite(blob.data(), 1, blob.size(), stream);
+        fprintf(stream, "\n");
+        if (tags && mark % BENCH_TAG_EVERY == 0) {
+            fprintf(stream, "reset refs/tags/v%d\nfrom :%d\n\n", mark, mark);
+        }
+    }
+}
+
+// Creates BENCH_REPOS bare origins sharing one large history under dir/origins, changed of them get new commits
+// on main (tracked by the clones) and dev (not tracked). The origins run dir/upload-pack as remote.origin.uploadpack,
+// a wrapper that appends what upload-pack sends, which is what would cross the network, to dir/bytes
+void CreateBenchmarkRepositories(const fs::path& dir, int changed) {
+    fs::create_directories(dir / "origins");
+    unsigned seed = 2463534242u;
+
+    std::string history = (dir / "history").string();
+    FILE* stream = fopen(history.c_str(), "w");
+    WriteHistory(stream, "refs/heads/main", 1, BENCH_COMMITS, false, true, seed);
+    fprintf(stream, "reset refs/heads/dev\nfrom :%d\n\n", BENCH_COMMITS);
+    fclose(stream);
+    BenchmarkGit(dir, { "init", "--bare", "-q", "template.git" });
+    BenchmarkGit(dir / "template.git", { "symbolic-ref", "HEAD", "refs/heads/main" });
+    BenchmarkGit(dir / "template.git", { "fast-import", "--quiet" }, history);
+
+    for (int i = 0; i < BENCH_REPOS; i++) {
+        std::string origin = "origins/r" + std::to_string(i) + ".git";
+        BenchmarkGit(dir, { "clone", "--bare", "-q", "template.git", origin });
+        if (i < changed) {
+            stream = fopen(history.c_str(), "w");
+            WriteHistory(stream, "refs/heads/main", 1, BENCH_NEW_COMMITS, true, false, seed);
+            WriteHistory(stream, "refs/heads/dev", BENCH_NEW_COMMITS + 1, BENCH_NEW_COMMITS, true, false, seed);
+            fclose(stream);
+            BenchmarkGit(dir / origin, { "fast-import", "--quiet" }, history);
+        }
+    }
+
+    std::string uploadPack = (dir / "upload-pack").string();
+    stream = fopen(uploadPack.c_str(), "w");
+    fprintf(stream, "#!/bin/sh\ngit upload-pack \"$@\" | { tee /dev/fd/3 | wc -c >> '%s'; } 3>&1\n", (dir / "bytes").c_str());
+    fclose(stream);
+    fs::permissions(uploadPack, fs::perms::owner_all);
+}
+
+// Fresh clones of the untouched history in dir/scan, with the origins as remote
+void CloneForScan(const fs::path& dir) {
+    fs::remove_all(dir / "scan");
+    fs::create_directories(dir / "scan");
+    for (int i = 0; i < BENCH_REPOS; i++) {
+        fs::path clone = dir / "scan" / ("r" + std::to_string(i));
+        BenchmarkGit(dir, { "clone", "-q", "template.git", clone.string() });
+        BenchmarkGit(clone, { "remote", "set-url", "origin", (dir / "origins" / ("r" + std::to_string(i) + ".git")).string() });
+        BenchmarkGit(clone, { "config", "remote.origin.uploadpack", (dir / "upload-pack").string() });
+    }
+    fs::remove(dir / "bytes");
+}
+
+// Scans BENCH_REPOS fresh clones once per mode, BENCH_CHANGED of the origins have moved
+int RunBenchmark() {
+    fs::path dir = fs::temp_directory_path() / ("lab1-benchmark-" + std::to_string(getpid()));
+    CreateBenchmarkRepositories(dir, BENCH_CHANGED);
+
+    const char* names[] = { "full fetch", "probe + fetch", "probe + tracked fetch" };
+    printf("mode,repositories,updated,wall ms,upload-pack sessions,bytes transferred\n");
+    for (int mode = FULL_FETCH; mode <= PROBE_FETCH_TRACKED; mode++) {
+        CloneForScan(dir);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<fs::path> updated = FindUpdatedRepositories(dir / "scan", (ScanMode)mode, false);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        long long bytes = 0, sessions = 0, count;
+        FILE* counts = fopen((dir / "bytes").c_str(), "r");
+        while (counts && fscanf(counts, "%lld", &count) == 1) {
+            bytes += count;
+            sessions++;
+        }
+        if (counts) {
+            fclose(counts);
+        }
+        printf("%s,%d,%zu,%.1f,%lld,%lld\n", names[mode], BENCH_REPOS, updated.size(), ms, sessions, bytes);
+    }
+
+    fs::remove_all(dir);
+    return 0;
+}
+
+// Stands in for interactive work: a 4 KB write + fdatasync every BENCH_PROBE_INTERVAL_MS, latencies in microseconds
+struct ForegroundProbe {
+    std::atomic<bool> stop{ false };
+    std::vector<double> latencies;
+    std::thread thread;
+
+    void start(const fs::path& file) {
+        stop.store(false);
+        latencies.clear();
+        thread = std::thread([this, file] {
+            int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            std::vector<char> block(4096, 'x');
+            for (int i = 0; !stop.load(); i++) {
+                auto begin = std::chrono::steady_clock::now();
+                if (pwrite(fd, block.data(), block.size(), (off_t)(i % 256) * block.size()) == (ssize_t)block.size()) {
+                    fdatasync(fd);
+                }
+                latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+                std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_PROBE_INTERVAL_MS));
+            }
+            close(fd);
+        });
+    }
+
+    void finish() {
+        stop.store(true);
+        thread.join();
+        std::sort(latencies.begin(), latencies.end());
+    }
+
+    double percentile(double p) {
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+    }
+};
+
+// Every origin has moved. Compares the sequential scan at nice 19 with the governed one, while ForegroundProbe measures
+// what the scan costs interactive work. The probe writes to TMPDIR, point that at a real disk, tmpfs never waits
+int RunGovernorBenchmark() {
+    fs::path dir = fs::temp_directory_path() / ("lab1-benchmark-" + std::to_string(getpid()));
+    CreateBenchmarkRepositories(dir, BENCH_REPOS);
+    ForegroundProbe probe;
+
+    printf("scan,wall ms,peak fetches,updated,foreground p50 us,foreground p99 us,foreground max us,probes\n");
+    probe.start(dir / "foreground");
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    probe.finish();
+    printf("idle,0,0,0,%.0f,%.0f,%.0f,%zu\n", probe.percentile(0.5), probe.percentile(0.99), probe.percentile(1), probe.latencies.size());
+
+    for (int governed = 0; governed <= 1; governed++) {
+        CloneForScan(dir);
+        probe.start(dir / "foreground");
+        auto start = std::chrono::steady_clock::now();
+        std::vector<fs::path> updated = FindUpdatedRepositories(dir / "scan", PROBE_FETCH, governed);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        probe.finish();
+        printf("%s,%.1f,%d,%zu,%.0f,%.0f,%.0f,%zu\n", governed ? "governed" : "sequential", ms, governed ? governorPeak : 1, updated.size(),
+               probe.percentile(0.5), probe.percentile(0.99), probe.percentile(1), probe.latencies.size());
+    }
+
+    fs::remove_all(dir);
+    return 0;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    // Set Ctrl-C handler
+#ifdef _WIN32
+    SetConsoleCtrlHandler((PHANDLER_ROUTINE)CtrlCHandler, TRUE);
+#else
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+        return RunBenchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--governor-benchmark") == 0) {
+        return RunGovernorBenchmark();
+    }
+    signal(SIGINT, OnInterrupt);
+    signal(SIGTERM, OnInterrupt);
+#endif
+
+    // Get the current directory
+    fs::path currentDir = fs::current_path();
+    ScanMode mode = !PROBE ? FULL_FETCH : FETCH_TRACKED_ONLY ? PROBE_FETCH_TRACKED : PROBE_FETCH;
+    std::vector<fs::path> updatedRepositories = FindUpdatedRepositories(currentDir, mode, GOVERNOR);
 
     // Display updated repositories
     if (updatedRepositories.empty()) {
@@ -146,6 +664,12 @@ int main() {
             std::cout << repo << std::endl;
         }
     }
+#ifndef _WIN32
+    if (interrupted) {
+        std::cout << "Interrupted, the remaining repositories were not checked." << std::endl;
+        return 1;
+    }
+#endif
 
     return 0;
 }
@@ -1,8 +1,10 @@
 #include <SDL.h>
+#include "AlignedRows.h"
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <chrono>
+#include <cstring>
 #ifdef _WIN32
 #include <Windows.h>
 #else
@@ -33,7 +35,7 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    SDL_Surface* image = SDL_LoadBMP("image.bmp");
+    SDL_Surface* image = loadAlignedBMP("image.bmp");
     if (!image) {
         std::cerr << "Error: Unable to load image - " << SDL_GetError() << std::endl;
         SDL_Quit();
@@ -105,7 +107,7 @@ int main(int argc, char* argv[]) {
 
     SDL_SaveBMP(image, "output.bmp");
 
-    SDL_FreeSurface(image);
+    freeAlignedRows(image);
     SDL_Quit();
     return 0;
 }
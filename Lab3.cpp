@@ -1,9 +1,13 @@
 #include <SDL.h>
+#include "AlignedRows.h"
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <chrono>
+#include <cstring>
 #include <queue>
+#include <atomic>
+#include <csignal>
 #include <time.h>
 #ifdef _WIN32
 #include <Windows.h>
@@ -17,6 +21,7 @@
 #define THREADS 1
 #define MAX_WORKERS 12
 #define CONTRAST_FACTOR 128
+#define DEADLINE_MS 0 // > 0 = Give up when the image is not done this many milliseconds after start, Ctrl-C cancels at any time
 
 void decreaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFactor) {
     for (int y = startY; y < endY; ++y) {
@@ -29,13 +34,30 @@ void decreaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFa
     }
 }
 
+std::atomic<bool> cancelled(false);
+
+void onInterrupt(int) {
+    cancelled.store(true);
+}
+
+// Checked by the workers before every row, the row in flight is always finished
+bool jobCancelled(std::chrono::steady_clock::time_point deadline) {
+    if (DEADLINE_MS > 0 && !cancelled.load(std::memory_order_relaxed) && std::chrono::steady_clock::now() >= deadline) {
+        cancelled.store(true);
+    }
+    return cancelled.load(std::memory_order_relaxed);
+}
+
 int main(int argc, char* argv[]) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DEADLINE_MS);
+    signal(SIGINT, onInterrupt);
+
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
         return -1;
     }
 
-    SDL_Surface* image = SDL_LoadBMP("image.bmp");
+    SDL_Surface* image = loadAlignedBMP("image.bmp");
     if (!image) {
         std::cerr << "Error: Unable to load image - " << SDL_GetError() << std::endl;
         SDL_Quit();
@@ -64,13 +86,16 @@ int main(int argc, char* argv[]) {
     std::vector<std::thread> threads;
 
     for (int i = 0; i < THREADS; ++i) {
-        threads.emplace_back([&rowsToProcess, &image, &queueMutex, &currentlyWorking] {
+        threads.emplace_back([&rowsToProcess, &image, &queueMutex, &currentlyWorking, deadline] {
 #if _WIN32
             SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
 #else
             pthread_setschedparam(pthread_self(), SCHED_BATCH, new sched_param { sched_priority: 20 });
 #endif
             while (true) {
+                if (jobCancelled(deadline)) {
+                    break;
+                }
 #ifdef _WIN32
                 WaitForSingleObject(queueMutex, INFINITE);
 #else
@@ -156,11 +181,19 @@ int main(int argc, char* argv[]) {
 
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
 
-    printf("Time taken: %d microseconds\n", duration.count());
+    printf("Time taken: %lld microseconds\n", (long long)duration.count());
+
+    // Nothing has been written yet, so a cancelled job leaves no partial output behind
+    if (cancelled.load()) {
+        std::cerr << "Cancelled, " << rowsToProcess.size() << " of " << image->h << " rows not processed" << std::endl;
+        freeAlignedRows(image);
+        SDL_Quit();
+        return 1;
+    }
 
     SDL_SaveBMP(image, "output.bmp");
 
-    SDL_FreeSurface(image);
+    freeAlignedRows(image);
     SDL_Quit();
     return 0;
 }
@@ -1,9 +1,19 @@
 #include <SDL.h>
+#include "Lab4-library.h"
+#include "BMPHeader.h"
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <chrono>
 #include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <climits>
+#include <cstdint>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -13,7 +23,15 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
-#include <atomic>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <linux/fs.h>
+#include <cstring>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <algorithm>
 
 #define max std::max
 #define min std::min
@@ -23,6 +41,18 @@
 #define MAX_WORKERS 12
 #define CONTRAST_FACTOR 128
 
+#define OUTPUT_CACHE 1 // 1 = Serve repeated image/parameter combinations from CACHE_DIR instead of recomputing (Linux only)
+#define CACHE_DIR ".contrast-cache"
+#define CACHE_MAX_BYTES (1024LL * 1024 * 1024) // Least recently used entries are evicted above this size
+#define CACHE_HASH_CHUNK (1 << 20) // Fixed so the key does not depend on THREADS
+
+#define SURFACE_POOL 1 // 1 = Decode uncompressed BMPs into pooled, huge-page backed buffers that are reused across calls (Linux only)
+#define POOL_ROW_ALIGN 64 // Row pitch alignment of pooled surfaces, one cache line
+#define POOL_HUGE_PAGE (2 * 1024 * 1024)
+#define POOL_MAX_IDLE 4 // Idle buffers kept for the next call, the rest are unmapped
+
+#define JOB_THREADS 4 // Library threads running jobs queued by increaseContrastAsync, each job still splits its rows over THREADS workers
+
 void increaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFactor) {
     for (int y = startY; y < endY; ++y) {
         for (int x = 0; x < image->w; ++x) {
@@ -34,16 +64,379 @@ void increaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFa
     }
 }
 
-#ifdef _WIN32
-extern "C" __declspec(dllexport) int increaseContrast(std::string path) {
-#else
-extern "C" int increaseContrast(std::string path) {
+#ifndef _WIN32
+std::atomic<unsigned> tempCounter(0);
+
+// A name next to path that no other job or process uses. Files are written there and renamed over path,
+// so readers only ever see the old file or the complete new one
+std::string tempPath(const std::string& path) {
+    return path + "." + std::to_string(getpid()) + "-" + std::to_string(tempCounter++) + ".tmp";
+}
 #endif
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-        std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
-        return -1;
+
+#if OUTPUT_CACHE && !defined(_WIN32)
+Uint64 hashMix(Uint64 h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+Uint64 hashChunk(const Uint8* data, size_t length, Uint64 seed) {
+    Uint64 h = seed ^ (length * 0x9E3779B97F4A7C15ull);
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        Uint64 v;
+        memcpy(&v, data + i, 8);
+        h = (h ^ hashMix(v)) * 0x9E3779B97F4A7C15ull;
+        h = (h << 31) | (h >> 33);
+    }
+    for (; i < length; i++) {
+        h = (h ^ data[i]) * 0x100000001B3ull;
+    }
+    return hashMix(h);
+}
+
+// Key = hash of the whole input (chunks hashed in parallel straight from the mapping) + file size + parameters
+std::string cacheKey(const char* data, size_t size) {
+    size_t chunks = (size + CACHE_HASH_CHUNK - 1) / CACHE_HASH_CHUNK;
+    std::vector<Uint64> chunkHashes(chunks);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREADS && (size_t)i < chunks; ++i) {
+        threads.emplace_back([&next, &chunkHashes, chunks, data, size] {
+            for (size_t chunk = next++; chunk < chunks; chunk = next++) {
+                size_t offset = chunk * CACHE_HASH_CHUNK;
+                chunkHashes[chunk] = hashChunk((const Uint8*)data + offset, min((size_t)CACHE_HASH_CHUNK, size - offset), chunk);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    Uint64 h = 0;
+    for (Uint64 chunkHash : chunkHashes) {
+        h = hashMix(h ^ chunkHash) + 0x9E3779B97F4A7C15ull;
+    }
+    char key[64];
+    snprintf(key, sizeof(key), "%016llx-%llx-c%d", (unsigned long long)h, (unsigned long long)size, CONTRAST_FACTOR);
+    return key;
+}
+
+// Tries a reflink, then an in-kernel copy, then read/write. Never a hardlink: other programs rewrite
+// output.bmp in place, which would silently change a cache entry that shares its inode. to must not exist yet
+bool cloneOrCopy(const std::string& from, const std::string& to) {
+    int in = open(from.c_str(), O_RDONLY);
+    if (in == -1) {
+        return false;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (out == -1) {
+        close(in);
+        return false;
+    }
+    bool ok = ioctl(out, FICLONE, in) == 0;
+    struct stat sb;
+    if (!ok && fstat(in, &sb) == 0) {
+        off_t copied = 0;
+        while (copied < sb.st_size) {
+            ssize_t n = copy_file_range(in, NULL, out, NULL, sb.st_size - copied, 0);
+            if (n <= 0) {
+                break;
+            }
+            copied += n;
+        }
+        // copy_file_range is refused across file systems on older kernels
+        char buffer[1 << 16];
+        ssize_t n = 1;
+        while (copied < sb.st_size && (n = pread(in, buffer, sizeof(buffer), copied)) > 0 && write(out, buffer, n) == n) {
+            copied += n;
+        }
+        ok = copied == sb.st_size;
+    }
+    close(in);
+    if (close(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        unlink(to.c_str());
+    }
+    return ok;
+}
+
+std::mutex cacheStatsMutex;
+
+// Hit/miss counters are kept in CACHE_DIR/stats so they add up across runs. The mutex covers the jobs of
+// this process, flock the other processes sharing the cache
+void cacheCount(bool hit) {
+    std::lock_guard<std::mutex> lock(cacheStatsMutex);
+    std::string path = std::string(CACHE_DIR) + "/stats";
+    long long hits = 0, misses = 0;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd != -1 && flock(fd, LOCK_EX) == 0) {
+        char text[64] = {};
+        if (pread(fd, text, sizeof(text) - 1, 0) <= 0 || sscanf(text, "%lld %lld", &hits, &misses) != 2) {
+            hits = misses = 0;
+        }
+        (hit ? hits : misses)++;
+        int length = snprintf(text, sizeof(text), "%lld %lld\n", hits, misses);
+        if (pwrite(fd, text, length, 0) == length) {
+            ftruncate(fd, length);
+        }
+    } else {
+        (hit ? hits : misses)++;
+    }
+    if (fd != -1) {
+        close(fd); // Also drops the lock
+    }
+    printf("Cache %s (%lld hits, %lld misses, %.1f%% hit rate)\n", hit ? "hit" : "miss", hits, misses, 100.0 * hits / (hits + misses));
+}
+
+bool cacheServe(const std::string& key, const std::string& output) {
+    mkdir(CACHE_DIR, 0777);
+    std::string entry = std::string(CACHE_DIR) + "/" + key + ".bmp";
+    std::string temp = tempPath(output);
+    bool hit = access(entry.c_str(), R_OK) == 0 && cloneOrCopy(entry, temp) && rename(temp.c_str(), output.c_str()) == 0;
+    if (hit) {
+        utimensat(AT_FDCWD, entry.c_str(), NULL, 0); // mtime is the LRU timestamp
+    } else {
+        unlink(temp.c_str());
+    }
+    cacheCount(hit);
+    return hit;
+}
+
+void cacheEvict() {
+    struct Entry {
+        std::string path;
+        off_t size;
+        struct timespec mtime;
+    };
+    std::vector<Entry> entries;
+    long long total = 0;
+    DIR* dir = opendir(CACHE_DIR);
+    if (!dir) {
+        return;
+    }
+    while (struct dirent* e = readdir(dir)) {
+        std::string name = e->d_name;
+        struct stat sb;
+        std::string path = std::string(CACHE_DIR) + "/" + name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bmp") == 0 && stat(path.c_str(), &sb) == 0) {
+            entries.push_back({ path, sb.st_size, sb.st_mtim });
+            total += sb.st_size;
+        }
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec;
+    });
+    for (size_t i = 0; i < entries.size() && total > CACHE_MAX_BYTES; i++) {
+        if (unlink(entries[i].path.c_str()) == 0) {
+            total -= entries[i].size;
+        }
+    }
+}
+
+// Publishes through a temporary name so concurrent runs and concurrent jobs never see a partial entry
+void cacheStore(const std::string& key, const std::string& output) {
+    std::string entry = std::string(CACHE_DIR) + "/" + key + ".bmp";
+    std::string temp = tempPath(entry);
+    if (cloneOrCopy(output, temp) && rename(temp.c_str(), entry.c_str()) == 0) {
+        cacheEvict();
+    } else {
+        unlink(temp.c_str());
+    }
+}
+#endif
+
+#if SURFACE_POOL && !defined(_WIN32)
+struct PoolBlock {
+    void* base;
+    size_t size;
+};
+
+std::mutex poolMutex;
+std::vector<PoolBlock> poolIdle;
+
+// Prefers explicit 2 MB pages, falls back to a normal mapping that transparent huge pages may back
+PoolBlock poolAcquire(size_t bytes) {
+    size_t size = (bytes + POOL_HUGE_PAGE - 1) / POOL_HUGE_PAGE * POOL_HUGE_PAGE;
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        // Reuse the smallest idle block that fits without wasting more than half of it
+        int best = -1;
+        for (size_t i = 0; i < poolIdle.size(); i++) {
+            if (poolIdle[i].size >= size && poolIdle[i].size <= 2 * size && (best == -1 || poolIdle[i].size < poolIdle[best].size)) {
+                best = i;
+            }
+        }
+        if (best != -1) {
+            PoolBlock block = poolIdle[best];
+            poolIdle.erase(poolIdle.begin() + best);
+            return block;
+        }
+    }
+
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return { NULL, 0 };
+        }
+        madvise(base, size, MADV_HUGEPAGE);
+    }
+    return { base, size };
+}
+
+void poolRelease(PoolBlock block) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    poolIdle.push_back(block);
+    if (poolIdle.size() > POOL_MAX_IDLE) {
+        munmap(poolIdle.front().base, poolIdle.front().size);
+        poolIdle.erase(poolIdle.begin());
+    }
+}
+
+// Copies an uncompressed 8/24/32-bit BMP straight from the mapping into a pooled surface.
+// Returns NULL for anything else, the caller then falls back to SDL_LoadBMP_RW
+SDL_Surface* loadPooledBMP(const char* data, size_t size, PoolBlock& block) {
+    BMPHeader header;
+    if (!parseBMPHeader((const Uint8*)data, size, header) || header.compression != 0 || (header.bpp != 8 && header.bpp != 24 && header.bpp != 32)) {
+        return NULL;
+    }
+    int w = header.w, h = header.h, bpp = header.bpp;
+    size_t stride = header.stride;
+    Uint32 format = bpp == 8 ? SDL_PIXELFORMAT_INDEX8 : bpp == 24 ? SDL_PIXELFORMAT_BGR24 : SDL_PIXELFORMAT_RGB888;
+    size_t pitch = ((size_t)w * (bpp / 8) + POOL_ROW_ALIGN - 1) / POOL_ROW_ALIGN * POOL_ROW_ALIGN;
+    if (pitch > INT_MAX || (size_t)h > SIZE_MAX / pitch) {
+        return NULL;
+    }
+
+    // block is only set once the surface owns it, so a failed load never leaves the caller something to release
+    PoolBlock acquired = poolAcquire(pitch * h);
+    if (!acquired.base) {
+        return NULL;
+    }
+    SDL_Surface* image = SDL_CreateRGBSurfaceWithFormatFrom(acquired.base, w, h, bpp, (int)pitch, format);
+    if (!image) {
+        poolRelease(acquired);
+        return NULL;
+    }
+
+    if (bpp == 8) {
+        const char* palette = data + 14 + header.headerSize;
+        SDL_Color entries[256];
+        for (int i = 0; i < header.colors; i++) {
+            entries[i] = { (Uint8)palette[4 * i + 2], (Uint8)palette[4 * i + 1], (Uint8)palette[4 * i], 255 };
+        }
+        SDL_SetPaletteColors(image->format->palette, entries, 0, header.colors);
+    }
+
+    for (int y = 0; y < h; y++) {
+        const char* row = data + header.dataOffset + (header.bottomUp ? h - 1 - y : y) * stride;
+        memcpy((Uint8*)image->pixels + (size_t)y * pitch, row, (size_t)w * bpp / 8);
+    }
+    block = acquired;
+    return image;
+}
+#endif
+
+#ifndef _WIN32
+// Minor page faults come from getrusage, dTLB load misses from a perf counter that also follows the worker threads
+struct MemoryCounters {
+    long minorFaults;
+    long long dtlbMisses;
+};
+
+// Counts dTLB read misses of this thread and the workers it starts afterwards. Closed by the destructor, so every return path releases it
+struct DtlbCounter {
+    int fd = -1;
+
+    explicit DtlbCounter(bool enabled);
+    ~DtlbCounter() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+};
+
+int openDtlbCounter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+DtlbCounter::DtlbCounter(bool enabled) : fd(enabled ? openDtlbCounter() : -1) {}
+
+MemoryCounters readMemoryCounters(int dtlbCounter) {
+    MemoryCounters counters = { 0, -1 };
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        counters.minorFaults = usage.ru_minflt;
+    }
+    long long value;
+    if (dtlbCounter != -1 && read(dtlbCounter, &value, sizeof(value)) == sizeof(value)) {
+        counters.dtlbMisses = value;
+    }
+    return counters;
+}
+
+void printMemoryCounters(const char* phase, const MemoryCounters& begin, const MemoryCounters& end) {
+    printf("%s: %ld minor page faults, ", phase, end.minorFaults - begin.minorFaults);
+    if (begin.dtlbMisses == -1 || end.dtlbMisses == -1) {
+        printf("dTLB misses n/a\n");
+    } else {
+        printf("%lld dTLB misses\n", end.dtlbMisses - begin.dtlbMisses);
+    }
+}
+#endif
+
+// cancelled is set by cancelContrastJob or once the deadline has passed, the workers check it before every row
+struct JobControl {
+    std::atomic<bool> cancelled{ false };
+    bool hasDeadline = false;
+    std::chrono::steady_clock::time_point deadline;
+
+    bool expired() {
+        if (hasDeadline && !cancelled.load(std::memory_order_relaxed) && std::chrono::steady_clock::now() >= deadline) {
+            cancelled.store(true);
+        }
+        return cancelled.load(std::memory_order_relaxed);
     }
+};
 
+// Owns the job's surface, so every return path frees it and hands a pooled buffer back
+struct JobSurface {
+    SDL_Surface* image = NULL;
+#if SURFACE_POOL && !defined(_WIN32)
+    PoolBlock block = { NULL, 0 };
+#endif
+
+    ~JobSurface() {
+        if (image) {
+            SDL_FreeSurface(image);
+        }
+#if SURFACE_POOL && !defined(_WIN32)
+        if (block.base) {
+            poolRelease(block);
+        }
+#endif
+    }
+};
+
+// Loads path, processes it and writes output. Only surface and RWops calls are used, so no SDL subsystem has to be initialized
+int contrastJob(const std::string& path, const std::string& output, bool progress, JobControl& control) {
+    JobSurface surface;
 #ifdef _WIN32
     std::wstring wpath(path.begin(), path.end());
     HANDLE hFile = CreateFile(
@@ -77,7 +470,7 @@ extern "C" int increaseContrast(std::string path) {
     }
 
     int file_size = GetFileSize(hFile, NULL);
-    SDL_Surface* image = SDL_LoadBMP_RW(SDL_RWFromMem(pBuf, file_size), 1);
+    surface.image = SDL_LoadBMP_RW(SDL_RWFromMem(pBuf, file_size), 1);
 
 
     UnmapViewOfFile(pBuf);
@@ -88,6 +481,14 @@ extern "C" int increaseContrast(std::string path) {
     struct stat sb;
     char* file_data;
 
+    auto loadStartTime = std::chrono::high_resolution_clock::now();
+    // Page faults (getrusage) are process-wide and so is what concurrent jobs do to the dTLB, so only the
+    // synchronous increaseContrast, which shows progress, reports them. Async jobs would mix in each other's numbers
+    bool report = progress;
+    DtlbCounter dtlb(report);
+    int dtlbCounter = dtlb.fd;
+    MemoryCounters loadBegin = readMemoryCounters(dtlbCounter);
+
     fd = open(path.c_str(), O_RDONLY);
     if (fd == -1) {
         std::cerr << "Error: Unable to open file" << std::endl;
@@ -96,25 +497,50 @@ extern "C" int increaseContrast(std::string path) {
 
     if (fstat(fd, &sb) == -1) {
         std::cerr << "Error: Unable to get file size" << std::endl;
+        close(fd);
         return 1;
     }
 
     file_data = static_cast<char*>(mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
     if (file_data == MAP_FAILED) {
         std::cerr << "Error: Unable to map file" << std::endl;
+        close(fd);
         return 1;
     }
-    SDL_Surface* image = SDL_LoadBMP_RW(SDL_RWFromMem(file_data, sb.st_size), 1);
+#if OUTPUT_CACHE
+    std::string key = cacheKey(file_data, sb.st_size);
+    if (cacheServe(key, output)) {
+        munmap(file_data, sb.st_size);
+        close(fd);
+        return 0;
+    }
+#endif
+#if SURFACE_POOL
+    surface.image = loadPooledBMP(file_data, sb.st_size, surface.block);
+    bool pooled = surface.image != NULL;
+    if (!surface.image) {
+        surface.image = SDL_LoadBMP_RW(SDL_RWFromMem(file_data, sb.st_size), 1);
+    }
+#else
+    surface.image = SDL_LoadBMP_RW(SDL_RWFromMem(file_data, sb.st_size), 1);
+    bool pooled = false;
+#endif
     int file_size = sb.st_size;
+    munmap(file_data, sb.st_size);
     close(fd);
 #endif
 
+    SDL_Surface* image = surface.image;
     if (!image) {
         std::cerr << "Error: Unable to load image - " << SDL_GetError() << std::endl;
-        SDL_Quit();
         return -1;
     }
     auto startTime = std::chrono::high_resolution_clock::now();
+#ifndef _WIN32
+    MemoryCounters processBegin = readMemoryCounters(dtlbCounter);
+    printf("Time to first pixel: %lld microseconds (%s surface)\n",
+           (long long)std::chrono::duration_cast<std::chrono::microseconds>(startTime - loadStartTime).count(), pooled ? "pooled" : "SDL");
+#endif
 
     std::queue<int> rowsToProcess;
     for (int i = 0; i < image->h; i++) {
@@ -137,13 +563,16 @@ extern "C" int increaseContrast(std::string path) {
     std::vector<std::thread> threads;
 
     for (int i = 0; i < THREADS; ++i) {
-        threads.emplace_back([&rowsToProcess, &image, &queueMutex, &currentlyWorking] {
+        threads.emplace_back([&rowsToProcess, &image, &queueMutex, &currentlyWorking, &control] {
 #if _WIN32
             SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
 #else
             pthread_setschedparam(pthread_self(), SCHED_BATCH, new sched_param{ sched_priority: 20 });
 #endif
             while (true) {
+                if (control.expired()) {
+                    break;
+                }
 #ifdef _WIN32
                 WaitForSingleObject(queueMutex, INFINITE);
 #else
@@ -185,32 +614,35 @@ extern "C" int increaseContrast(std::string path) {
             });
     }
 
-    std::atomic_bool done;
-    std::thread progressBar([&done, &rowsToProcess, &queueMutex, &image] {
-        while (true) {
+    std::atomic_bool done(false);
+    std::thread progressBar;
+    if (progress) {
+        progressBar = std::thread([&done, &rowsToProcess, &queueMutex, &image] {
+            while (true) {
 #ifdef _WIN32
-            WaitForSingleObject(queueMutex, INFINITE);
+                WaitForSingleObject(queueMutex, INFINITE);
 #else
-            pthread_mutex_lock(&queueMutex);
+                pthread_mutex_lock(&queueMutex);
 #endif
-            int left = rowsToProcess.size();
+                int left = rowsToProcess.size();
 #ifdef _WIN32
-            ReleaseMutex(queueMutex);
+                ReleaseMutex(queueMutex);
 #else
-            pthread_mutex_unlock(&queueMutex);
+                pthread_mutex_unlock(&queueMutex);
 #endif
-            printf("\u001b[2K\u001b[0G%.2f%%", 100 * (1 - (double)left / image->h));
-            if (done.load()) {
-                std::cout << "\u001b[2K\u001b[0G";
-                break;
-            }
+                printf("\u001b[2K\u001b[0G%.2f%%", 100 * (1 - (double)left / image->h));
+                if (done.load()) {
+                    std::cout << "\u001b[2K\u001b[0G";
+                    break;
+                }
 #ifdef _WIN32
-            Sleep(1); // 1ms
+                Sleep(1); // 1ms
 #else
-            usleep(1000); // 1ms
+                usleep(1000); // 1ms
 #endif
-        }
-        });
+            }
+            });
+    }
 
     for (auto& thread : threads) {
         thread.join();
@@ -219,7 +651,9 @@ extern "C" int increaseContrast(std::string path) {
     auto endTime = std::chrono::high_resolution_clock::now();
 
     done.store(true);
-    progressBar.join();
+    if (progressBar.joinable()) {
+        progressBar.join();
+    }
 
 #ifdef _WIN32
     CloseHandle(queueMutex);
@@ -229,10 +663,24 @@ extern "C" int increaseContrast(std::string path) {
 
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
 
-    printf("Time taken: %lld microseconds\n", duration.count());
+    printf("Time taken: %lld microseconds\n", (long long)duration.count());
+
+    // Nothing has been written yet, the surface goes straight back to the pool for the jobs still queued
+    if (control.cancelled.load()) {
+        std::cerr << "Cancelled, " << rowsToProcess.size() << " of " << image->h << " rows not processed" << std::endl;
+        return JOB_CANCELLED;
+    }
+#ifndef _WIN32
+    if (report) {
+        MemoryCounters processEnd = readMemoryCounters(dtlbCounter);
+        printMemoryCounters("Load", loadBegin, processBegin);
+        printMemoryCounters("Process", processBegin, processEnd);
+    }
+#endif
 
 #ifdef _WIN32
-    hFile = CreateFile(L"output.bmp", GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    std::wstring woutput(output.begin(), output.end());
+    hFile = CreateFile(woutput.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
     if (hFile == INVALID_HANDLE_VALUE) {
         std::cerr << "Could not open file." << std::endl;
         return 1;
@@ -263,35 +711,157 @@ extern "C" int increaseContrast(std::string path) {
     CloseHandle(hMap);
     CloseHandle(hFile);
 #else
-    fd = open("output.bmp", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    // Written under a temporary name and renamed over output once complete, so a failed save never
+    // leaves a partial file and a previous output (or a hardlink to it) is replaced, not written through
+    std::string temp = tempPath(output);
+    fd = open(temp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
     if (fd == -1) {
         std::cerr << "Error: Unable to open file" << std::endl;
         return 1;
     }
 
-    ftruncate(fd, file_size);
-
-    if (fstat(fd, &sb) == -1) {
+    if (ftruncate(fd, file_size) == -1 || fstat(fd, &sb) == -1) {
         std::cerr << "Error: Unable to get file size" << std::endl;
+        close(fd);
+        unlink(temp.c_str());
         return 1;
     }
 
     file_data = static_cast<char*>(mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
     if (file_data == MAP_FAILED) {
         std::cerr << "Error: Unable to map file" << std::endl;
+        close(fd);
+        unlink(temp.c_str());
         return 1;
     }
     SDL_SaveBMP_RW(image, SDL_RWFromMem(file_data, sb.st_size), 1);
-    if (msync(file_data, sb.st_size, MS_SYNC) == -1) {
+    bool synced = msync(file_data, sb.st_size, MS_SYNC) == 0;
+    munmap(file_data, sb.st_size);
+    close(fd);
+    if (!synced || rename(temp.c_str(), output.c_str()) != 0) {
         std::cerr << "Error: Unable to sync file" << std::endl;
+        unlink(temp.c_str());
         return 1;
     }
-    munmap(file_data, sb.st_size);
-    close(fd);
+#if OUTPUT_CACHE
+    cacheStore(key, output);
+#endif
 #endif
 
-    SDL_FreeSurface(image);
+    return 0;
+}
+
+#ifdef _WIN32
+extern "C" __declspec(dllexport) int increaseContrast(std::string path) {
+#else
+extern "C" int increaseContrast(std::string path) {
+#endif
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
+        return -1;
+    }
+    JobControl control;
+    int result = contrastJob(path, "output.bmp", true, control);
     SDL_Quit();
+    return result;
+}
+
+struct ContrastJob {
+    int id;
+    std::string path;
+    std::string output;
+    ContrastCallback callback;
+    void* userData;
+    std::shared_ptr<JobControl> control;
+};
+
+// Never destroyed, the detached job threads may still wait on it while the process exits
+struct JobPool {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::queue<ContrastJob> jobs;
+    std::map<int, std::shared_ptr<JobControl>> active; // Queued and running jobs, for cancelContrastJob
+    int nextId = 1;
+};
+
+JobPool* jobPool = new JobPool();
+std::once_flag jobPoolStarted;
+
+void jobThread() {
+    while (true) {
+        ContrastJob job;
+        {
+            std::unique_lock<std::mutex> lock(jobPool->mutex);
+            jobPool->ready.wait(lock, [] { return !jobPool->jobs.empty(); });
+            job = std::move(jobPool->jobs.front());
+            jobPool->jobs.pop();
+        }
+        // A job that timed out while queued is answered without loading anything
+        int result;
+        if (job.control->expired()) {
+            result = JOB_CANCELLED;
+        } else {
+            result = contrastJob(job.path, job.output, false, *job.control);
+        }
+        {
+            std::lock_guard<std::mutex> lock(jobPool->mutex);
+            jobPool->active.erase(job.id);
+        }
+        if (job.callback) {
+            job.callback(result, job.userData);
+        }
+    }
+}
+
+// Queues a job and returns at once: 0 = queued, -1 = bad arguments. callback(result, userData) runs on a
+// library thread once output has been written, result is what increaseContrast would have returned or
+// JOB_CANCELLED. timeoutMs > 0 is a deadline counted from now, including the time spent in the queue.
+// jobId, if given, receives the id for cancelContrastJob before the job can start.
+// Any number of jobs may be in flight, JOB_THREADS of them run at a time and the rest wait in order
+#ifdef _WIN32
+extern "C" __declspec(dllexport) int increaseContrastAsync(const char* path, const char* output, int timeoutMs, ContrastCallback callback, void* userData, int* jobId) {
+#else
+extern "C" int increaseContrastAsync(const char* path, const char* output, int timeoutMs, ContrastCallback callback, void* userData, int* jobId) {
+#endif
+    if (!path || !output) {
+        return -1;
+    }
+    std::shared_ptr<JobControl> control = std::make_shared<JobControl>();
+    if (timeoutMs > 0) {
+        control->hasDeadline = true;
+        control->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    }
+    std::call_once(jobPoolStarted, [] {
+        for (int i = 0; i < JOB_THREADS; i++) {
+            std::thread(jobThread).detach();
+        }
+    });
+    {
+        std::lock_guard<std::mutex> lock(jobPool->mutex);
+        int id = jobPool->nextId++;
+        if (jobId) {
+            *jobId = id;
+        }
+        jobPool->active[id] = control;
+        jobPool->jobs.push({ id, path, output, callback, userData, control });
+    }
+    jobPool->ready.notify_one();
+    return 0;
+}
+
+// 0 = the job was queued or running and will finish with JOB_CANCELLED at its next row, -1 = no such job (any more).
+// A job that is already writing its output completes normally
+#ifdef _WIN32
+extern "C" __declspec(dllexport) int cancelContrastJob(int jobId) {
+#else
+extern "C" int cancelContrastJob(int jobId) {
+#endif
+    std::lock_guard<std::mutex> lock(jobPool->mutex);
+    auto job = jobPool->active.find(jobId);
+    if (job == jobPool->active.end()) {
+        return -1;
+    }
+    job->second->cancelled.store(true);
     return 0;
 }
 
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+
+#define JOB_CANCELLED 2 // Result of a job that was cancelled or missed its deadline, output is left as it was
+
+// Runs on a library thread when a job queued by increaseContrastAsync has finished, result is what increaseContrast would return or JOB_CANCELLED
+typedef void (*ContrastCallback)(int result, void* userData);
+
+extern "C" int increaseContrast(std::string path);
+// Returns at once, 0 = queued. The result is written to output, not output.bmp. timeoutMs > 0 is a deadline
+// counted from the call, jobId (may be NULL) receives the id for cancelContrastJob before the job can start
+extern "C" int increaseContrastAsync(const char* path, const char* output, int timeoutMs, ContrastCallback callback, void* userData, int* jobId);
+// 0 = the job will finish with JOB_CANCELLED, -1 = it has already finished
+extern "C" int cancelContrastJob(int jobId);
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+
+// int result = co_await contrastAsync("in.bmp", "out.bmp", 500, &jobId);
+// The coroutine is suspended while the job waits and runs, so one thread can keep any number of jobs in flight.
+// It resumes on the library thread that ran the job, hand off to your own executor there if the continuation is long
+struct ContrastAwaiter {
+    std::string path;
+    std::string output;
+    int timeoutMs;
+    int* jobId;
+    int result;
+    std::coroutine_handle<> handle;
+
+    bool await_ready() {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        handle = h;
+        // The callback may resume the coroutine before increaseContrastAsync returns, so nothing here touches this afterwards
+        if (increaseContrastAsync(path.c_str(), output.c_str(), timeoutMs, resume, this, jobId) != 0) {
+            result = -1;
+            return false;
+        }
+        return true;
+    }
+
+    int await_resume() {
+        return result;
+    }
+
+    static void resume(int result, void* userData) {
+        ContrastAwaiter* awaiter = (ContrastAwaiter*)userData;
+        awaiter->result = result;
+        awaiter->handle.resume();
+    }
+};
+
+inline ContrastAwaiter contrastAsync(std::string path, std::string output, int timeoutMs = 0, int* jobId = nullptr) {
+    return { std::move(path), std::move(output), timeoutMs, jobId, -1, {} };
+}
+#endif
@@ -1,8 +1,43 @@
 #include <iostream>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "Lab4-library.h"
 
-extern "C" int increaseContrast(std::string path);
+#define ASYNC_JOBS 8
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+// Fire-and-forget coroutine, the frame frees itself when the body finishes
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+Detached process(std::string output, std::atomic<int>& left) {
+	int result = co_await contrastAsync("image.bmp", output);
+	printf("%s: %d\n", output.c_str(), result);
+	left--;
+}
+#endif
 
 int main() {
 	int result = increaseContrast("image.bmp");
 	std::cout << "Statically linked result: " << result << std::endl;
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+	// All jobs are queued from this thread, none of them waits for another
+	std::atomic<int> left(ASYNC_JOBS);
+	for (int i = 0; i < ASYNC_JOBS; i++) {
+		process("output-" + std::to_string(i) + ".bmp", left);
+	}
+	while (left.load() > 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+#endif
 }
@@ -0,0 +1,486 @@
+#include <SDL.h>
+#include "BMPHeader.h"
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <fstream>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define max std::max
+#define min std::min
+#endif
+
+#define THREADS 12
+#define CONTRAST_FACTOR 128
+#define BATCH_JOBS 4 // Images processed at the same time, each splits its rows over THREADS / BATCH_JOBS threads
+#define MEMORY_BUDGET (512LL << 20) // RSS the whole process may use, jobs are admitted while their estimates fit in what is left
+#define BANDED_ABOVE (MEMORY_BUDGET / 4) // Images with a larger working set are streamed through a band buffer instead of decoded whole
+#define BAND_BYTES (16 << 20) // Band buffer of the banded path
+#define JOB_OVERHEAD (1 << 20) // Added to every estimate for SDL, stdio buffers and thread stacks
+#define SMALL_BELOW (256 << 10) // Uncompressed files up to this size are read whole and processed in batches instead of one job each
+#define SMALL_BATCH_BYTES (8 << 20) // File bytes per batch, at most SMALL_IN_FLIGHT batches exist between reader, workers and writer
+#define SMALL_IN_FLIGHT 5 // One being read, one queued, one being processed, one queued, one being written
+#define SMALL_CHUNK_ROWS 64 // Rows a worker takes from a batch at a time, a chunk runs on across image boundaries
+
+void decreaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFactor) {
+    for (int y = startY; y < endY; ++y) {
+        for (int x = 0; x < image->w; ++x) {
+            Uint8* pixel = (Uint8*)image->pixels + y * image->pitch + x * image->format->BytesPerPixel;
+            for (int c = 0; c < image->format->BytesPerPixel; ++c) {
+                pixel[c] = max(0, pixel[c] - contrastFactor);
+            }
+        }
+    }
+}
+
+// Same kernel on raw BMP rows, every byte of a pixel is a channel (or, for 8-bit images, the palette index, like on the surface)
+void decreaseContrastRows(Uint8* rows, size_t stride, size_t rowBytes, int count, Uint8 contrastFactor) {
+    for (int y = 0; y < count; ++y) {
+        Uint8* row = rows + y * stride;
+        for (size_t i = 0; i < rowBytes; ++i) {
+            row[i] = max(0, row[i] - contrastFactor);
+        }
+    }
+}
+
+// Runs fn(0..count-1) on threads threads, items are handed out one at a time
+void parallelFor(int count, int threads, const std::function<void(int)>& fn) {
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back([&next, count, &fn] {
+#if _WIN32
+            SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+#else
+            pthread_setschedparam(pthread_self(), SCHED_BATCH, new sched_param{ sched_priority: 20 });
+#endif
+            for (int item = next++; item < count; item = next++) {
+                fn(item);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+long long currentRss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? (long long)counters.WorkingSetSize : 0;
+#else
+    long long pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%lld %lld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+long long peakRss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? (long long)counters.PeakWorkingSetSize : 0;
+#else
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss * 1024LL : 0; // ru_maxrss is in KB on Linux
+#endif
+}
+
+// Uncompressed 8/16/24/32-bit (BI_RGB, or BI_BITFIELDS which only moves the channels around), the pixel
+// data can be streamed row by row
+bool isBanded(const BMPHeader& header) {
+    return (header.compression == 0 || header.compression == 3) && (header.bpp == 8 || header.bpp == 16 || header.bpp == 24 || header.bpp == 32);
+}
+
+bool readBMPHeader(FILE* file, BMPHeader& header) {
+    Uint8 data[54];
+    if (fseek(file, 0, SEEK_END) != 0) {
+        return false;
+    }
+    long size = ftell(file);
+    return size >= 54 && fseek(file, 0, SEEK_SET) == 0 && fread(data, 1, sizeof(data), file) == sizeof(data) && parseBMPHeader(data, size, header);
+}
+
+// Bytes the SDL path needs: the decoded surface, SDL turns 1- and 4-bit images into 8-bit ones
+long long decodedBytes(const BMPHeader& header) {
+    int bytesPerPixel = max(8, header.bpp) / 8;
+    long long pitch = ((long long)header.w * bytesPerPixel + 3) / 4 * 4;
+    return pitch * header.h + JOB_OVERHEAD;
+}
+
+// The band buffer and the copy of everything before the pixel data
+long long bandedBytes(const BMPHeader& header) {
+    return (long long)max(header.stride, min((size_t)BAND_BYTES, header.stride * header.h)) + header.dataOffset + JOB_OVERHEAD;
+}
+
+// Grants memory in submission order, so a large image is not starved by the small ones behind it.
+// A job larger than the whole budget is still admitted once it is alone
+struct Admission {
+    std::mutex mutex;
+    std::condition_variable changed;
+    long long budget;
+    long long inUse = 0;
+    long long peakInUse = 0;
+    int nextTicket = 0;
+
+    void acquire(int ticket, long long bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this, ticket, bytes] { return ticket == nextTicket && (inUse + bytes <= budget || inUse == 0); });
+        inUse += bytes;
+        peakInUse = max(peakInUse, inUse);
+        nextTicket++;
+        changed.notify_all();
+    }
+
+    // For a job that never got as far as acquire, so the ones behind it are not stuck
+    void skip(int ticket) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this, ticket] { return ticket == nextTicket; });
+        nextTicket++;
+        changed.notify_all();
+    }
+
+    void release(long long bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        inUse -= bytes;
+        changed.notify_all();
+    }
+};
+
+// Bounded FIFO between pipeline stages, pop fails once the channel is closed and drained
+template <typename T>
+struct Channel {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+    explicit Channel(size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        changed.notify_all();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        changed.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        changed.notify_all();
+    }
+};
+
+std::string outputPath(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? "output-" + path : path.substr(0, slash + 1) + "output-" + path.substr(slash + 1);
+}
+
+// Copies the header and palette as they are, then reads, processes and writes BAND_BYTES of rows at a time.
+// The file is measured again before anything is written, it may have changed since its header was read.
+// A read or write that still fails removes the output, so no truncated image is left behind
+bool processBanded(FILE* input, const BMPHeader& header, const std::string& output, int threads) {
+    long size = fseek(input, 0, SEEK_END) == 0 ? ftell(input) : -1;
+    if (size < 0 || (size_t)size < header.dataOffset || ((size_t)size - header.dataOffset) / header.stride < (size_t)header.h) {
+        SDL_SetError("The file is shorter than its header says");
+        return false;
+    }
+    FILE* out = fopen(output.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    std::vector<Uint8> band(max(header.stride, min((size_t)BAND_BYTES, header.stride * header.h)));
+    std::vector<Uint8> prefix(header.dataOffset);
+    bool ok = fseek(input, 0, SEEK_SET) == 0
+        && fread(prefix.data(), 1, prefix.size(), input) == prefix.size()
+        && fwrite(prefix.data(), 1, prefix.size(), out) == prefix.size();
+
+    int bandRows = (int)(band.size() / header.stride);
+    size_t rowBytes = (size_t)header.w * header.bpp / 8;
+    for (int y = 0; ok && y < header.h; y += bandRows) {
+        int rows = min(bandRows, header.h - y);
+        size_t bytes = rows * header.stride;
+        if (fread(band.data(), 1, bytes, input) != bytes) {
+            ok = false;
+            break;
+        }
+        int chunkRows = max(1, rows / threads);
+        parallelFor((rows + chunkRows - 1) / chunkRows, threads, [&band, &header, rowBytes, rows, chunkRows](int chunk) {
+            int start = chunk * chunkRows;
+            decreaseContrastRows(band.data() + start * header.stride, header.stride, rowBytes, min(chunkRows, rows - start), CONTRAST_FACTOR);
+        });
+        ok = fwrite(band.data(), 1, bytes, out) == bytes;
+    }
+    // Anything after the pixel data (an ICC profile of a V5 header) is copied too
+    size_t n;
+    while (ok && (n = fread(band.data(), 1, band.size(), input)) > 0) {
+        ok = fwrite(band.data(), 1, n, out) == n;
+    }
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        SDL_SetError("Unable to copy the rows to %s", output.c_str());
+        remove(output.c_str());
+    }
+    return ok;
+}
+
+bool processDecoded(const std::string& path, const std::string& output, int threads) {
+    SDL_Surface* image = SDL_LoadBMP(path.c_str());
+    if (!image) {
+        return false;
+    }
+    parallelFor(image->h, threads, [image](int y) {
+        decreaseContrast(image, y, y + 1, CONTRAST_FACTOR);
+    });
+    bool ok = SDL_SaveBMP(image, output.c_str()) == 0;
+    SDL_FreeSurface(image);
+    if (!ok) {
+        remove(output.c_str());
+    }
+    return ok;
+}
+
+// A whole small file, processed in place and written back out as it is
+struct SmallImage {
+    std::string path;
+    std::vector<Uint8> file;
+    BMPHeader header;
+};
+
+// Small images processed as one job. Their rows form a single range, so a 64-row image costs a share of
+// one chunk instead of a thread start, and threads stay busy however the rows are spread over the images
+struct Batch {
+    std::vector<SmallImage> images;
+    std::vector<int> firstRow{ 0 }; // Of every image in the range, plus the total at the end
+    size_t bytes = 0;
+};
+
+void processBatch(Batch& batch, int threads) {
+    int rows = batch.firstRow.back();
+    int chunks = (rows + SMALL_CHUNK_ROWS - 1) / SMALL_CHUNK_ROWS;
+    parallelFor(chunks, min(threads, chunks), [&batch, rows](int chunk) {
+        int row = chunk * SMALL_CHUNK_ROWS;
+        int end = min(row + SMALL_CHUNK_ROWS, rows);
+        size_t i = std::upper_bound(batch.firstRow.begin(), batch.firstRow.end(), row) - batch.firstRow.begin() - 1;
+        for (; row < end; i++) {
+            SmallImage& image = batch.images[i];
+            int count = min(end, batch.firstRow[i + 1]) - row;
+            Uint8* rowData = image.file.data() + image.header.dataOffset + (row - batch.firstRow[i]) * image.header.stride;
+            decreaseContrastRows(rowData, image.header.stride, (size_t)image.header.w * image.header.bpp / 8, count, CONTRAST_FACTOR);
+            row += count;
+        }
+    });
+}
+
+// Reads a small, uncompressed image whole. false = it goes down the one-job-per-image path instead
+bool readSmall(FILE* input, const std::string& path, SmallImage& image) {
+    if (fseek(input, 0, SEEK_END) != 0) {
+        return false;
+    }
+    long size = ftell(input);
+    if (size < 54 || size > SMALL_BELOW || fseek(input, 0, SEEK_SET) != 0) {
+        return false;
+    }
+    image.file.resize(size);
+    if (fread(image.file.data(), 1, size, input) != (size_t)size || !parseBMPHeader(image.file.data(), size, image.header)) {
+        return false;
+    }
+    image.path = path;
+    return isBanded(image.header);
+}
+
+struct LargeJob {
+    std::string path;
+    int ticket;
+};
+
+// Usage: Lab5-batch image.bmp [image.bmp ...] - every image is written to output-<name>, @list.txt stands for the paths in it, one per line
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " image.bmp [image.bmp ...] | @list.txt" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '@') {
+            paths.push_back(argv[i]);
+            continue;
+        }
+        std::ifstream list(argv[i] + 1);
+        if (!list) {
+            std::cerr << "Error: Unable to open list " << argv[i] + 1 << std::endl;
+            return 1;
+        }
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty()) {
+                paths.push_back(line);
+            }
+        }
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
+        return -1;
+    }
+
+    Admission admission;
+    long long baseline = currentRss();
+    admission.budget = MEMORY_BUDGET - baseline - (long long)SMALL_IN_FLIGHT * SMALL_BATCH_BYTES;
+    int rowThreads = max(1, THREADS / BATCH_JOBS);
+
+    std::atomic<int> batched(0), banded(0), failed(0);
+    std::atomic<long long> pixelBytes(0);
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    // Large images: BATCH_JOBS jobs at a time under the memory budget
+    Channel<LargeJob> largeJobs(paths.size() + 1);
+    std::vector<std::thread> jobs;
+    for (int i = 0; i < BATCH_JOBS; i++) {
+        jobs.emplace_back([&] {
+            for (LargeJob job; largeJobs.pop(job);) {
+                const std::string& path = job.path;
+                FILE* input = fopen(path.c_str(), "rb");
+                BMPHeader header;
+                if (!input || !readBMPHeader(input, header)) {
+                    std::cerr << "Error: Unable to read BMP header of " << path << std::endl;
+                    if (input) {
+                        fclose(input);
+                    }
+                    admission.skip(job.ticket);
+                    failed++;
+                    continue;
+                }
+
+                long long estimate = decodedBytes(header);
+                bool useBands = estimate > BANDED_ABOVE && isBanded(header);
+                if (useBands) {
+                    estimate = bandedBytes(header);
+                    banded++;
+                } else if (estimate > BANDED_ABOVE) {
+                    std::cerr << "Warning: " << path << " is compressed and needs " << (estimate >> 20) << " MB, it is decoded whole" << std::endl;
+                }
+
+                admission.acquire(job.ticket, estimate);
+                bool ok = useBands ? processBanded(input, header, outputPath(path), rowThreads) : processDecoded(path, outputPath(path), rowThreads);
+                fclose(input);
+                admission.release(estimate);
+
+                if (ok) {
+                    pixelBytes += (long long)header.w * header.h * max(8, header.bpp) / 8;
+                } else {
+                    std::cerr << "Error: Unable to process " << path << " - " << SDL_GetError() << std::endl;
+                    failed++;
+                }
+            }
+        });
+    }
+
+    // Small images: this thread reads them into batches, one thread runs each batch on THREADS workers, one writes them out
+    Channel<std::unique_ptr<Batch>> readBatches(1), writeBatches(1);
+    std::thread batchThread([&] {
+        for (std::unique_ptr<Batch> batch; readBatches.pop(batch);) {
+            processBatch(*batch, THREADS);
+            writeBatches.push(std::move(batch));
+        }
+        writeBatches.close();
+    });
+    std::thread writerThread([&] {
+        for (std::unique_ptr<Batch> batch; writeBatches.pop(batch);) {
+            for (SmallImage& image : batch->images) {
+                FILE* out = fopen(outputPath(image.path).c_str(), "wb");
+                bool ok = out && fwrite(image.file.data(), 1, image.file.size(), out) == image.file.size();
+                if (out && fclose(out) != 0) {
+                    ok = false;
+                }
+                if (ok) {
+                    pixelBytes += (long long)image.header.w * image.header.h * image.header.bpp / 8;
+                } else {
+                    std::cerr << "Error: Unable to write " << outputPath(image.path) << std::endl;
+                    failed++;
+                }
+            }
+        }
+    });
+
+    int nextTicket = 0;
+    std::unique_ptr<Batch> batch(new Batch());
+    for (const std::string& path : paths) {
+        FILE* input = fopen(path.c_str(), "rb");
+        if (!input) {
+            std::cerr << "Error: Unable to open " << path << std::endl;
+            failed++;
+            continue;
+        }
+        SmallImage image;
+        if (!readSmall(input, path, image)) {
+            largeJobs.push({ path, nextTicket++ });
+            fclose(input);
+            continue;
+        }
+        fclose(input);
+        batched++;
+        batch->bytes += image.file.size();
+        batch->firstRow.push_back(batch->firstRow.back() + image.header.h);
+        batch->images.push_back(std::move(image));
+        if (batch->bytes >= SMALL_BATCH_BYTES) {
+            readBatches.push(std::move(batch));
+            batch.reset(new Batch());
+        }
+    }
+    if (!batch->images.empty()) {
+        readBatches.push(std::move(batch));
+    }
+    readBatches.close();
+    largeJobs.close();
+
+    batchThread.join();
+    writerThread.join();
+    for (auto& job : jobs) {
+        job.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+    int images = (int)paths.size() - failed;
+    printf("Processed %d images (%d batched, %d banded, %d failed) in %.3f s: %.1f images/s, %.1f MB/s of pixels\n",
+           images, batched.load(), banded.load(), failed.load(), seconds, images / seconds, pixelBytes / seconds / (1 << 20));
+    printf("Budget %lld MB, peak admitted %lld MB, peak RSS %lld MB (baseline %lld MB)\n",
+           MEMORY_BUDGET >> 20, admission.peakInUse >> 20, peakRss() >> 20, baseline >> 20);
+
+    SDL_Quit();
+    return failed > 0 ? 1 : 0;
+}
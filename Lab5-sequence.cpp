@@ -0,0 +1,239 @@
+#include <SDL.h>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HASH_SSE2 1
+#else
+#define HASH_SSE2 0
+#endif
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+#define max std::max
+#define min std::min
+#endif
+
+#define THREADS 12
+#define CONTRAST_FACTOR 128
+#define TILE_ROWS 16 // Rows per tile, a tile is hashed, compared and reprocessed as a unit
+
+void decreaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFactor) {
+    for (int y = startY; y < endY; ++y) {
+        for (int x = 0; x < image->w; ++x) {
+            Uint8* pixel = (Uint8*)image->pixels + y * image->pitch + x * image->format->BytesPerPixel;
+            for (int c = 0; c < image->format->BytesPerPixel; ++c) {
+                pixel[c] = max(0, pixel[c] - contrastFactor);
+            }
+        }
+    }
+}
+
+const Uint32 PRIME1 = 0x9E3779B1u;
+const Uint32 PRIME2 = 0x85EBCA77u;
+const Uint32 PRIME3 = 0xC2B2AE3Du;
+
+#if HASH_SSE2
+// SSE2 has no 32-bit low multiply, build it from the two 32x32->64 multiplies
+inline __m128i mullo32(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+inline Uint32 rotl32(Uint32 v, int r) {
+    return (v << r) | (v >> (32 - r));
+}
+
+// xxHash32-style hash with four 32-bit lanes; the SSE2 path and the scalar path compute the same value
+void hashUpdate(Uint32 lanes[4], const Uint8* data, size_t length) {
+    size_t i = 0;
+#if HASH_SSE2
+    __m128i acc = _mm_loadu_si128((const __m128i*)lanes);
+    const __m128i prime1 = _mm_set1_epi32((int)PRIME1);
+    const __m128i prime2 = _mm_set1_epi32((int)PRIME2);
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        acc = _mm_add_epi32(acc, mullo32(v, prime2));
+        acc = _mm_or_si128(_mm_slli_epi32(acc, 13), _mm_srli_epi32(acc, 19));
+        acc = mullo32(acc, prime1);
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+#else
+    for (; i + 16 <= length; i += 16) {
+        for (int l = 0; l < 4; l++) {
+            Uint32 v;
+            memcpy(&v, data + i + 4 * l, 4);
+            lanes[l] = rotl32(lanes[l] + v * PRIME2, 13) * PRIME1;
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        lanes[i & 3] = rotl32(lanes[i & 3] + data[i] * PRIME3, 11) * PRIME1;
+    }
+}
+
+Uint64 hashFinish(const Uint32 lanes[4]) {
+    Uint64 h = ((Uint64)(rotl32(lanes[0], 1) + rotl32(lanes[1], 7)) << 32) | (rotl32(lanes[2], 12) + rotl32(lanes[3], 18));
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Hashes only the pixel bytes of the tile, the padding at the end of each row is ignored
+Uint64 hashTile(SDL_Surface* image, int startY, int endY) {
+    Uint32 lanes[4] = { PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1 };
+    size_t rowBytes = (size_t)image->w * image->format->BytesPerPixel;
+    for (int y = startY; y < endY; y++) {
+        hashUpdate(lanes, (const Uint8*)image->pixels + (size_t)y * image->pitch, rowBytes);
+    }
+    return hashFinish(lanes);
+}
+
+// Runs fn(0..count-1) on up to THREADS threads, items are handed out one at a time
+void parallelFor(int count, const std::function<void(int)>& fn) {
+    std::atomic<int> next(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < min(THREADS, count); ++i) {
+        threads.emplace_back([&next, count, &fn] {
+#if _WIN32
+            SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+#else
+            pthread_setschedparam(pthread_self(), SCHED_BATCH, new sched_param{ sched_priority: 20 });
+#endif
+            for (int item = next++; item < count; item = next++) {
+                fn(item);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+double elapsedUs(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Usage: Lab5-sequence frame0001.bmp frame0002.bmp ... - every frame is written to output-<name>
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " frame.bmp [frame.bmp ...]" << std::endl;
+        return 1;
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
+        return -1;
+    }
+
+    SDL_Surface* previousOutput = NULL;
+    std::vector<Uint64> previousHashes;
+
+    long long totalTiles = 0, skippedTiles = 0;
+    double totalUs = 0, estimatedFullUs = 0;
+    double fullUsPerTile = 0; // Process time of the latest frame that had every tile reprocessed, per tile
+
+    for (int frame = 1; frame < argc; frame++) {
+        std::string path = argv[frame];
+        SDL_Surface* image = SDL_LoadBMP(path.c_str());
+        if (!image) {
+            std::cerr << "Error: Unable to load image " << path << " - " << SDL_GetError() << std::endl;
+            continue;
+        }
+        auto startTime = std::chrono::high_resolution_clock::now();
+
+        int tiles = (image->h + TILE_ROWS - 1) / TILE_ROWS;
+        std::vector<Uint64> hashes(tiles);
+        parallelFor(tiles, [&hashes, image](int tile) {
+            hashes[tile] = hashTile(image, tile * TILE_ROWS, min(image->h, (tile + 1) * TILE_ROWS));
+        });
+        double hashUs = elapsedUs(startTime);
+
+        // A frame with a different geometry or format than the previous one is reprocessed completely
+        bool comparable = previousOutput && previousOutput->w == image->w && previousOutput->h == image->h
+            && previousOutput->pitch == image->pitch && previousOutput->format->format == image->format->format
+            && (int)previousHashes.size() == tiles;
+
+        std::vector<int> dirty, clean;
+        for (int tile = 0; tile < tiles; tile++) {
+            if (comparable && hashes[tile] == previousHashes[tile]) {
+                clean.push_back(tile);
+            } else {
+                dirty.push_back(tile);
+            }
+        }
+
+        auto processStart = std::chrono::high_resolution_clock::now();
+        parallelFor((int)dirty.size(), [&dirty, image](int i) {
+            int tile = dirty[i];
+            decreaseContrast(image, tile * TILE_ROWS, min(image->h, (tile + 1) * TILE_ROWS), CONTRAST_FACTOR);
+        });
+        double processUs = elapsedUs(processStart);
+        // Only a pass over the whole frame pays thread start-up the way full reprocessing would, so only that is the baseline
+        if ((int)dirty.size() == tiles) {
+            fullUsPerTile = processUs / tiles;
+        }
+
+        // Unchanged tiles take the previous result instead of running the kernel again
+        auto reuseStart = std::chrono::high_resolution_clock::now();
+        parallelFor((int)clean.size(), [&clean, image, previousOutput](int i) {
+            int tile = clean[i];
+            int startY = tile * TILE_ROWS;
+            int endY = min(image->h, (tile + 1) * TILE_ROWS);
+            memcpy((Uint8*)image->pixels + (size_t)startY * image->pitch,
+                   (Uint8*)previousOutput->pixels + (size_t)startY * previousOutput->pitch,
+                   (size_t)(endY - startY) * image->pitch);
+        });
+        double reuseUs = elapsedUs(reuseStart);
+        double frameUs = elapsedUs(startTime);
+
+        totalTiles += tiles;
+        skippedTiles += clean.size();
+        totalUs += frameUs;
+        estimatedFullUs += fullUsPerTile * tiles;
+
+        printf("%s: %zu/%d tiles skipped (%.1f%%), hash %.0f us, process %.0f us, reuse %.0f us, total %.0f us\n",
+               path.c_str(), clean.size(), tiles, 100.0 * clean.size() / tiles, hashUs, processUs, reuseUs, frameUs);
+
+        std::string output;
+        size_t slash = path.find_last_of("/\\");
+        output = slash == std::string::npos ? "output-" + path : path.substr(0, slash + 1) + "output-" + path.substr(slash + 1);
+        if (SDL_SaveBMP(image, output.c_str()) != 0) {
+            std::cerr << "Error: Unable to save " << output << " - " << SDL_GetError() << std::endl;
+        }
+
+        if (previousOutput) {
+            SDL_FreeSurface(previousOutput);
+        }
+        previousOutput = image;
+        previousHashes.swap(hashes);
+    }
+
+    if (totalTiles > 0) {
+        printf("Skipped %lld of %lld tiles (%.1f%%)\n", skippedTiles, totalTiles, 100.0 * skippedTiles / totalTiles);
+        printf("Time taken: %.0f microseconds, full reprocessing estimated at %.0f microseconds (%.0f saved)\n",
+               totalUs, estimatedFullUs, estimatedFullUs - totalUs);
+    }
+
+    if (previousOutput) {
+        SDL_FreeSurface(previousOutput);
+    }
+    SDL_Quit();
+    return 0;
+}
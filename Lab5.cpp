@@ -1,9 +1,28 @@
 #include <SDL.h>
+#include "AlignedRows.h"
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <chrono>
+#include <cstring>
 #include <queue>
+#include <atomic>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <memory>
+#include <csignal>
+#include <mutex>
+#include <condition_variable>
+#include <climits>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PYRAMID_SSE2 1
+#else
+#define PYRAMID_SSE2 0
+#endif
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -13,6 +32,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 #define max std::max
 #define min std::min
@@ -21,6 +41,218 @@
 #define THREADS 12
 #define MAX_WORKERS 12
 #define CONTRAST_FACTOR 128
+#define OUTPUT_RLE 0 // 1 = Write 8-bit images RLE8 compressed
+#define CODEC_ITERATIONS 10 // Samples per codec in --codec-benchmark
+#define MAX_RLE_PIXELS (1 << 28) // RLE8/RLE4 input larger than this is rejected, the stream does not bound the image size
+#define INPUT_POLICY INPUT_AUTO // How image.bmp is mapped (Linux), see InputPolicy
+#define INPUT_BAND_BYTES (4 << 20) // INPUT_BANDS: bytes each decoding thread prefetches ahead of itself and releases behind
+#define INPUT_POPULATE_BELOW (64 << 20) // INPUT_AUTO: files up to this size are populated (warm) or read ahead whole (cold)
+#define INPUT_WARM 0.9 // INPUT_AUTO: fraction of the file in the page cache from which it counts as warm
+#define WRITE_BEHIND 1 // 1 = Stream finished rows to output.bmp while workers are still running (Linux, uncompressed output)
+#define WRITE_BEHIND_ROWS 64 // Finished rows collected before a write is issued
+#define PYRAMID_LEVELS 0 // N = Also write 1/2 .. 1/2^N previews as output-1-<2^k>.bmp, built in the same pass as the contrast
+#define TILE_ROWS (1 << PYRAMID_LEVELS) // Rows per queue entry, enough to produce whole rows in every pyramid level
+#define DEADLINE_MS 0 // > 0 = Give up when the image is not done this many milliseconds after start, Ctrl-C cancels at any time
+#define PERF_COUNTERS 0 // 1 = Count cycles, instructions, LLC misses, context switches and mutex wait per thread and phase (Linux only)
+#define TRACE 0 // 1 = Record a per-thread timeline and write it to trace.json (chrome://tracing, ui.perfetto.dev)
+
+#if PERF_COUNTERS
+#ifdef _WIN32
+#error "PERF_COUNTERS needs perf_event_open, which is Linux only"
+#endif
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#define PERF_EVENTS 4
+
+const char* PERF_EVENT_NAMES[PERF_EVENTS] = { "cycles", "instructions", "LLC misses", "ctx switches" };
+
+struct PerfCounters {
+    int fds[PERF_EVENTS];
+};
+
+struct PerfSample {
+    Uint64 values[PERF_EVENTS];
+    Uint64 mutexWaitNs;
+};
+
+// Counters follow the calling thread (pid 0, any CPU), every worker opens its own set. With inherit they also
+// count the threads it starts afterwards, added in when each of them exits
+PerfCounters perfOpen(bool inherit = false) {
+    const Uint32 types[PERF_EVENTS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE };
+    const Uint64 configs[PERF_EVENTS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES };
+    PerfCounters counters;
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.exclude_kernel = types[i] == PERF_TYPE_HARDWARE; // context switches happen in the kernel
+        attr.exclude_hv = 1;
+        attr.inherit = inherit;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters.fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    return counters;
+}
+
+// Values are scaled up when the kernel had to multiplex counters, -1 marks an unavailable counter
+PerfSample perfRead(const PerfCounters& counters) {
+    PerfSample sample = {};
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        Uint64 data[3]; // value, time enabled, time running
+        if (counters.fds[i] == -1 || read(counters.fds[i], data, sizeof(data)) != sizeof(data)) {
+            sample.values[i] = (Uint64)-1;
+            continue;
+        }
+        sample.values[i] = data[2] ? (Uint64)((double)data[0] * data[1] / data[2]) : 0;
+    }
+    return sample;
+}
+
+void perfClose(const PerfCounters& counters) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (counters.fds[i] != -1) {
+            close(counters.fds[i]);
+        }
+    }
+}
+
+PerfSample perfDelta(const PerfSample& begin, const PerfSample& end) {
+    PerfSample delta = {};
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        bool valid = begin.values[i] != (Uint64)-1 && end.values[i] != (Uint64)-1;
+        delta.values[i] = valid ? end.values[i] - begin.values[i] : (Uint64)-1;
+    }
+    delta.mutexWaitNs = end.mutexWaitNs - begin.mutexWaitNs;
+    return delta;
+}
+
+void perfAccumulate(PerfSample& total, const PerfSample& sample) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        total.values[i] = total.values[i] == (Uint64)-1 || sample.values[i] == (Uint64)-1 ? (Uint64)-1 : total.values[i] + sample.values[i];
+    }
+    total.mutexWaitNs += sample.mutexWaitNs;
+}
+
+void perfPrintRow(const char* name, const PerfSample& sample) {
+    printf("%-12s", name);
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (sample.values[i] == (Uint64)-1) {
+            printf(" %14s", "n/a");
+        } else {
+            printf(" %14llu", (unsigned long long)sample.values[i]);
+        }
+    }
+    bool haveIpc = sample.values[0] != (Uint64)-1 && sample.values[1] != (Uint64)-1 && sample.values[0] != 0;
+    printf(" %6.2f %14.1f\n", haveIpc ? (double)sample.values[1] / sample.values[0] : 0.0, sample.mutexWaitNs / 1000.0);
+}
+
+void perfPrintHeader() {
+    printf("%-12s", "");
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        printf(" %14s", PERF_EVENT_NAMES[i]);
+    }
+    printf(" %6s %14s\n", "IPC", "mutex wait us");
+}
+
+PerfSample perfThreadSamples[THREADS];
+thread_local Uint64 perfMutexWaitNs = 0;
+#endif
+
+#if PERF_COUNTERS || TRACE
+Uint64 nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+#if TRACE
+#define TRACE_CAPACITY 65536 // Events kept per thread, older ones are overwritten
+#define TRACE_MIN_LOCK_WAIT_NS 1000 // Uncontended locks are not worth an event
+
+enum TraceKind { TRACE_ROW, TRACE_LOCK_WAIT, TRACE_IDLE, TRACE_LOAD, TRACE_PROCESS, TRACE_SAVE };
+
+const char* TRACE_NAMES[] = { "row", "lock wait", "idle", "load", "process", "save" };
+
+struct TraceEvent {
+    Uint64 startNs;
+    Uint64 endNs;
+    int kind;
+    int arg;
+};
+
+// Each thread only ever writes its own ring, so no synchronisation is needed until the dump after join
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    Uint64 written = 0;
+};
+
+std::vector<TraceBuffer> traceBuffers(THREADS + 1); // 0 = main thread, i + 1 = worker i
+thread_local TraceBuffer* traceBuffer = NULL;
+Uint64 traceEpochNs = 0;
+
+// Rings are allocated up front so that workers do not fault in fresh pages while they are being timed
+void traceInit() {
+    for (TraceBuffer& buffer : traceBuffers) {
+        buffer.events.resize(TRACE_CAPACITY);
+    }
+    traceEpochNs = nowNs();
+}
+
+void traceAttach(int index) {
+    traceBuffer = &traceBuffers[index];
+}
+
+void traceEvent(int kind, Uint64 startNs, Uint64 endNs, int arg = -1) {
+    traceBuffer->events[traceBuffer->written++ % TRACE_CAPACITY] = { startNs, endNs, kind, arg };
+}
+
+void traceWrite(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        std::cerr << "Error: Unable to write trace" << std::endl;
+        return;
+    }
+    fprintf(out, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Lab5\"}}");
+    for (size_t t = 0; t < traceBuffers.size(); t++) {
+        std::string name = t == 0 ? "main" : "worker " + std::to_string(t - 1);
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", t, name.c_str());
+
+        const TraceBuffer& buffer = traceBuffers[t];
+        Uint64 first = buffer.written > TRACE_CAPACITY ? buffer.written - TRACE_CAPACITY : 0;
+        for (Uint64 i = first; i < buffer.written; i++) {
+            const TraceEvent& e = buffer.events[i % TRACE_CAPACITY];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f",
+                    TRACE_NAMES[e.kind], t, (e.startNs - traceEpochNs) / 1000.0, (e.endNs - e.startNs) / 1000.0);
+            if (e.arg != -1) {
+                fprintf(out, ",\"args\":{\"row\":%d}", e.arg);
+            }
+            fprintf(out, "}");
+        }
+        if (first > 0) {
+            std::cerr << "Trace: " << name << " dropped " << first << " oldest events" << std::endl;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+}
+#endif
+
+#if PERF_COUNTERS || TRACE
+// Called by a worker right after it acquired queueMutex, startNs is when it started waiting
+void recordLockWait(Uint64 startNs) {
+    Uint64 endNs = nowNs();
+#if PERF_COUNTERS
+    perfMutexWaitNs += endNs - startNs;
+#endif
+#if TRACE
+    if (endNs - startNs >= TRACE_MIN_LOCK_WAIT_NS) {
+        traceEvent(TRACE_LOCK_WAIT, startNs, endNs);
+    }
+#endif
+}
+#endif
 
 void decreaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFactor) {
     for (int y = startY; y < endY; ++y) {
@@ -33,12 +265,901 @@ void decreaseContrast(SDL_Surface* image, int startY, int endY, Uint8 contrastFa
     }
 }
 
+// Native BMP codec. Uncompressed images are decoded and encoded in parallel row bands straight
+// between the file mapping and the aligned working surface. RLE8/RLE4 input gets a quick sequential
+// pass that records where every row starts in the stream, then the bands decode in parallel.
+// 1 and 4-bit images are expanded to 8-bit indices like SDL does. Anything else returns NULL and
+// Lab5 falls back to SDL_LoadBMP_RW
+
+#define BI_RGB 0
+#define BI_RLE8 1
+#define BI_RLE4 2
+
+// The shared header plus where the palette is in the mapping
+struct BMPInfo : BMPHeader {
+    const Uint8* palette;
+};
+
+void writeLE16(Uint8* p, Uint16 v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+void writeLE32(Uint8* p, Uint32 v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+bool parseBMP(const Uint8* data, size_t size, BMPInfo& info) {
+    if (!parseBMPHeader(data, size, info)) {
+        return false;
+    }
+    bool supported = (info.compression == BI_RGB && (info.bpp == 1 || info.bpp == 4 || info.bpp == 8 || info.bpp == 24 || info.bpp == 32))
+        || (info.compression == BI_RLE8 && info.bpp == 8 && info.bottomUp)
+        || (info.compression == BI_RLE4 && info.bpp == 4 && info.bottomUp);
+    // The file size does not bound an RLE stream, only this limit does
+    if (!supported || (info.compression != BI_RGB && (size_t)info.h > MAX_RLE_PIXELS / (size_t)info.w)) {
+        return false;
+    }
+    info.palette = info.colors ? data + 14 + info.headerSize : NULL;
+    return true;
+}
+
+// Splits rows into THREADS contiguous bands and runs fn(startRow, endRow) for each on its own thread
+void parallelBands(int rows, const std::function<void(int, int)>& fn) {
+    int bands = max(1, min(THREADS, rows));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < bands; ++i) {
+        threads.emplace_back([i, bands, rows, &fn] {
+            fn((int)((long long)rows * i / bands), (int)((long long)rows * (i + 1) / bands));
+        });
+    }
+    fn(0, rows / bands);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Converts one stored row (file layout) into one surface row
+void decodeRow(const BMPInfo& info, const Uint8* src, Uint8* dst) {
+    switch (info.bpp) {
+    case 1:
+        for (int x = 0; x < info.w; x++) {
+            dst[x] = (src[x >> 3] >> (7 - (x & 7))) & 1;
+        }
+        break;
+    case 4:
+        for (int x = 0; x < info.w; x++) {
+            dst[x] = x & 1 ? src[x >> 1] & 0x0F : src[x >> 1] >> 4;
+        }
+        break;
+    default:
+        memcpy(dst, src, (size_t)info.w * info.bpp / 8);
+    }
+}
+
+// Decoder state at the point where the RLE stream first reaches a row; y may already be past
+// that row when a delta skipped it
+struct RLECheckpoint {
+    size_t offset;
+    int x;
+    int y;
+};
+
+// Walks the opcodes without touching pixels and returns a checkpoint for every row (file order)
+std::vector<RLECheckpoint> indexRLE(const Uint8* stream, size_t length, const BMPInfo& info) {
+    std::vector<RLECheckpoint> checkpoints(info.h, { length, 0, info.h });
+    size_t pos = 0;
+    int x = 0, y = 0, next = 0;
+    auto mark = [&] {
+        for (; next <= y && next < info.h; next++) {
+            checkpoints[next] = { pos, x, y };
+        }
+    };
+    mark();
+    while (pos + 1 < length && y < info.h) {
+        Uint8 count = stream[pos], code = stream[pos + 1];
+        if (count > 0) {
+            pos += 2;
+            x += count;
+        } else if (code == 0) {
+            pos += 2;
+            x = 0;
+            y++;
+            mark();
+        } else if (code == 1) {
+            break;
+        } else if (code == 2) {
+            if (pos + 3 >= length) {
+                break;
+            }
+            x += stream[pos + 2];
+            y += stream[pos + 3];
+            pos += 4;
+            mark();
+        } else {
+            size_t bytes = info.compression == BI_RLE8 ? code : (code + 1) / 2;
+            pos += 2 + ((bytes + 1) & ~(size_t)1);
+            x += code;
+        }
+    }
+    return checkpoints;
+}
+
+// Decodes from a checkpoint until the stream leaves [.., endRow), file rows are bottom-up
+void decodeRLE(const Uint8* stream, size_t length, const BMPInfo& info, RLECheckpoint start, int endRow, SDL_Surface* image) {
+    size_t pos = start.offset;
+    int x = start.x, y = start.y;
+    bool rle8 = info.compression == BI_RLE8;
+    auto put = [&](Uint8 index) {
+        if (x < info.w && y < info.h) {
+            ((Uint8*)image->pixels)[(size_t)(info.h - 1 - y) * image->pitch + x] = index;
+        }
+        x++;
+    };
+    while (pos + 1 < length && y < endRow) {
+        Uint8 count = stream[pos], code = stream[pos + 1];
+        if (count > 0) {
+            for (int i = 0; i < count; i++) {
+                put(rle8 ? code : i & 1 ? code & 0x0F : code >> 4);
+            }
+            pos += 2;
+        } else if (code == 0) {
+            pos += 2;
+            x = 0;
+            y++;
+        } else if (code == 1) {
+            break;
+        } else if (code == 2) {
+            if (pos + 3 >= length) {
+                break;
+            }
+            x += stream[pos + 2];
+            y += stream[pos + 3];
+            pos += 4;
+        } else {
+            size_t bytes = rle8 ? code : (code + 1) / 2;
+            if (pos + 2 + bytes > length) {
+                break;
+            }
+            const Uint8* literal = stream + pos + 2;
+            for (int i = 0; i < code; i++) {
+                put(rle8 ? literal[i] : i & 1 ? literal[i >> 1] & 0x0F : literal[i >> 1] >> 4);
+            }
+            pos += 2 + ((bytes + 1) & ~(size_t)1);
+        }
+    }
+}
+
+// How the input file is brought into memory. The mapping is only ever read once, front to back per thread,
+// so the choice is between paying for the page faults up front, spread over the decode, or overlapped with it
+enum InputPolicy {
+    INPUT_FAULT, // Plain mmap, every page is faulted in on first touch
+    INPUT_POPULATE, // MAP_POPULATE, mmap itself maps (and if needed reads) the whole file
+    INPUT_BANDS, // MADV_SEQUENTIAL, each thread asks for the next band with MADV_WILLNEED and drops finished bands with MADV_DONTNEED
+    INPUT_READAHEAD, // readahead() queues the whole file before the decode faults it in, finished bands are dropped as in INPUT_BANDS
+    INPUT_AUTO // Chosen per file from its size and how much of it is in the page cache, see chooseInputPolicy
+};
+
+const char* INPUT_POLICY_NAMES[] = { "fault", "populate", "bands", "readahead", "auto" };
+
+struct InputMapping {
+    const Uint8* data;
+    size_t size;
+    int fd;
+    InputPolicy policy; // Never INPUT_AUTO once mapped
+    double cached; // Fraction of the file that was in the page cache before mapping
+};
+
+#ifndef _WIN32
+size_t pageSize() {
+    static size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// Asks mincore about a throwaway mapping, nothing is faulted in
+double cachedFraction(int fd, size_t size) {
+    if (size == 0) {
+        return 1;
+    }
+    void* probe = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (probe == MAP_FAILED) {
+        return 0;
+    }
+    size_t pages = (size + pageSize() - 1) / pageSize();
+    std::vector<unsigned char> resident(pages);
+    size_t cached = 0;
+    if (mincore(probe, size, resident.data()) == 0) {
+        for (unsigned char page : resident) {
+            cached += page & 1;
+        }
+    }
+    munmap(probe, size);
+    return (double)cached / pages;
+}
+
+// Warm files cost only page faults: small ones are cheapest populated in one call, large ones are walked in
+// bands so the mapping never holds the whole file. Cold files cost disk reads: small ones are queued in one
+// readahead, large ones are prefetched a band ahead of every thread so reading overlaps decoding
+InputPolicy chooseInputPolicy(size_t size, double cached) {
+    if (cached >= INPUT_WARM) {
+        return size <= INPUT_POPULATE_BELOW ? INPUT_POPULATE : INPUT_BANDS;
+    }
+    return size <= INPUT_POPULATE_BELOW ? INPUT_READAHEAD : INPUT_BANDS;
+}
+
+bool mapInput(const char* path, InputPolicy policy, InputMapping& input) {
+    input.fd = open(path, O_RDONLY);
+    if (input.fd == -1) {
+        return false;
+    }
+    struct stat sb;
+    if (fstat(input.fd, &sb) == -1 || sb.st_size == 0) {
+        close(input.fd);
+        return false;
+    }
+    input.size = sb.st_size;
+    input.cached = cachedFraction(input.fd, input.size);
+    input.policy = policy == INPUT_AUTO ? chooseInputPolicy(input.size, input.cached) : policy;
+
+    int flags = MAP_PRIVATE | (input.policy == INPUT_POPULATE ? MAP_POPULATE : 0);
+    void* data = mmap(NULL, input.size, PROT_READ, flags, input.fd, 0);
+    if (data == MAP_FAILED) {
+        close(input.fd);
+        return false;
+    }
+    input.data = (const Uint8*)data;
+    if (input.policy == INPUT_BANDS || input.policy == INPUT_READAHEAD) {
+        madvise(data, input.size, MADV_SEQUENTIAL);
+    }
+    if (input.policy == INPUT_READAHEAD) {
+        readahead(input.fd, 0, input.size);
+    }
+    return true;
+}
+
+void unmapInput(InputMapping& input) {
+    munmap((void*)input.data, input.size);
+    close(input.fd);
+}
+#endif
+
+// Called by a decoding thread for the range it is about to read
+void inputBandAhead(const InputMapping* input, const Uint8* start, size_t length) {
+#ifndef _WIN32
+    if (input && input->policy == INPUT_BANDS && length > 0) {
+        uintptr_t from = (uintptr_t)start & ~(pageSize() - 1);
+        madvise((void*)from, (uintptr_t)start + length - from, MADV_WILLNEED);
+    }
+#endif
+}
+
+// Called by a decoding thread for a range it has finished with. Only whole pages inside the range are dropped,
+// a page shared with the neighbouring band is left to unmapInput
+void inputBandDone(const InputMapping* input, const Uint8* start, size_t length) {
+#ifndef _WIN32
+    if (input && (input->policy == INPUT_BANDS || input->policy == INPUT_READAHEAD)) {
+        uintptr_t from = ((uintptr_t)start + pageSize() - 1) & ~(pageSize() - 1);
+        uintptr_t to = ((uintptr_t)start + length) & ~(pageSize() - 1);
+        if (to > from) {
+            madvise((void*)from, to - from, MADV_DONTNEED);
+        }
+    }
+#endif
+}
+
+// input (may be NULL) receives band callbacks while uncompressed rows are decoded, RLE streams are released by unmapInput
+SDL_Surface* loadBMP(const Uint8* data, size_t size, const InputMapping* input = NULL) {
+    BMPInfo info;
+    if (!parseBMP(data, size, info)) {
+        return NULL;
+    }
+    int surfaceBpp = info.bpp <= 8 ? 8 : info.bpp;
+    Uint32 format = surfaceBpp == 8 ? SDL_PIXELFORMAT_INDEX8 : surfaceBpp == 24 ? SDL_PIXELFORMAT_BGR24 : SDL_PIXELFORMAT_RGB888;
+    SDL_Surface* image = createAlignedSurface(info.w, info.h, surfaceBpp, format);
+    if (!image) {
+        return NULL;
+    }
+    if (info.palette) {
+        SDL_Color colors[256];
+        for (int i = 0; i < info.colors; i++) {
+            colors[i] = { info.palette[4 * i + 2], info.palette[4 * i + 1], info.palette[4 * i], 255 };
+        }
+        SDL_SetPaletteColors(image->format->palette, colors, 0, info.colors);
+    }
+
+    const Uint8* pixels = data + info.dataOffset;
+    if (info.compression == BI_RGB) {
+        parallelBands(info.h, [&info, pixels, image, input](int startY, int endY) {
+            // Stored rows are walked in file order, so every thread reads its part of the file front to back
+            int first = info.bottomUp ? info.h - endY : startY;
+            int last = info.bottomUp ? info.h - startY : endY;
+            int bandRows = max(1, (int)(INPUT_BAND_BYTES / info.stride));
+            for (int band = first; band < last; band += bandRows) {
+                int bandEnd = min(band + bandRows, last);
+                if (band == first) {
+                    inputBandAhead(input, pixels + band * info.stride, (bandEnd - band) * info.stride);
+                }
+                inputBandAhead(input, pixels + bandEnd * info.stride, (min(bandEnd + bandRows, last) - bandEnd) * info.stride);
+                for (int stored = band; stored < bandEnd; stored++) {
+                    int y = info.bottomUp ? info.h - 1 - stored : stored;
+                    decodeRow(info, pixels + stored * info.stride, (Uint8*)image->pixels + (size_t)y * image->pitch);
+                }
+                inputBandDone(input, pixels + band * info.stride, (bandEnd - band) * info.stride);
+            }
+        });
+    } else {
+        std::vector<RLECheckpoint> checkpoints = indexRLE(pixels, info.dataSize, info);
+        parallelBands(info.h, [&info, &checkpoints, pixels, image](int startRow, int endRow) {
+            // Pixels the stream never writes (deltas, short rows, early end) stay index 0
+            for (int row = startRow; row < endRow; row++) {
+                memset((Uint8*)image->pixels + (size_t)(info.h - 1 - row) * image->pitch, 0, info.w);
+            }
+            if (startRow < endRow) {
+                decodeRLE(pixels, info.dataSize, info, checkpoints[startRow], endRow, image);
+            }
+        });
+    }
+    return image;
+}
+
+// Output side. prepareBMP works out the layout (and for RLE8 compresses the rows in parallel) so
+// the caller can size the file, writeBMP then fills the mapped file in parallel
+struct BMPEncoding {
+    int bpp;
+    Uint32 compression;
+    int colors;
+    size_t headerSize;
+    size_t stride;
+    size_t size;
+    std::vector<std::vector<Uint8>> rleRows; // File order, each ends with an end-of-line marker
+    std::vector<size_t> rleOffsets;
+};
+
+void encodeRLE8Row(const Uint8* row, int w, std::vector<Uint8>& out) {
+    int x = 0;
+    while (x < w) {
+        int run = 1;
+        while (x + run < w && run < 255 && row[x + run] == row[x]) {
+            run++;
+        }
+        if (run >= 2) {
+            out.push_back(run);
+            out.push_back(row[x]);
+            x += run;
+            continue;
+        }
+        // Literal stretch up to the next repeat, absolute mode needs at least 3 pixels
+        int literal = 1;
+        while (x + literal < w && literal < 255 && !(x + literal + 1 < w && row[x + literal] == row[x + literal + 1])) {
+            literal++;
+        }
+        if (literal < 3) {
+            for (int i = 0; i < literal; i++) {
+                out.push_back(1);
+                out.push_back(row[x + i]);
+            }
+        } else {
+            out.push_back(0);
+            out.push_back(literal);
+            out.insert(out.end(), row + x, row + x + literal);
+            if (literal & 1) {
+                out.push_back(0);
+            }
+        }
+        x += literal;
+    }
+    out.push_back(0);
+    out.push_back(0);
+}
+
+bool prepareBMP(SDL_Surface* image, bool rle, BMPEncoding& encoding) {
+    int bytes = image->format->BytesPerPixel;
+    bool indexed = bytes == 1 && image->format->palette;
+    if (!indexed && !(bytes == 3 && image->format->format == SDL_PIXELFORMAT_BGR24) && !(bytes == 4 && image->format->format == SDL_PIXELFORMAT_RGB888)) {
+        return false;
+    }
+    encoding.bpp = bytes * 8;
+    encoding.compression = rle && indexed ? BI_RLE8 : BI_RGB;
+    encoding.colors = indexed ? image->format->palette->ncolors : 0;
+    encoding.headerSize = 14 + 40 + 4 * (size_t)encoding.colors;
+    encoding.stride = ((size_t)image->w * encoding.bpp + 31) / 32 * 4;
+
+    if (encoding.compression == BI_RGB) {
+        encoding.size = encoding.headerSize + encoding.stride * image->h;
+        return true;
+    }
+
+    encoding.rleRows.assign(image->h, std::vector<Uint8>());
+    parallelBands(image->h, [image, &encoding](int startRow, int endRow) {
+        for (int row = startRow; row < endRow; row++) {
+            encodeRLE8Row((Uint8*)image->pixels + (size_t)(image->h - 1 - row) * image->pitch, image->w, encoding.rleRows[row]);
+        }
+    });
+    encoding.rleOffsets.resize(image->h);
+    size_t offset = encoding.headerSize;
+    for (int row = 0; row < image->h; row++) {
+        encoding.rleOffsets[row] = offset;
+        offset += encoding.rleRows[row].size();
+    }
+    encoding.size = offset + 2; // End of bitmap
+    return true;
+}
+
+void writeBMPHeader(SDL_Surface* image, const BMPEncoding& encoding, Uint8* out) {
+    memset(out, 0, encoding.headerSize);
+    out[0] = 'B';
+    out[1] = 'M';
+    writeLE32(out + 2, encoding.size);
+    writeLE32(out + 10, encoding.headerSize);
+    writeLE32(out + 14, 40);
+    writeLE32(out + 18, image->w);
+    writeLE32(out + 22, image->h);
+    writeLE16(out + 26, 1);
+    writeLE16(out + 28, encoding.bpp);
+    writeLE32(out + 30, encoding.compression);
+    writeLE32(out + 34, encoding.size - encoding.headerSize);
+    writeLE32(out + 38, 2835); // 72 DPI
+    writeLE32(out + 42, 2835);
+    writeLE32(out + 46, encoding.colors);
+    for (int i = 0; i < encoding.colors; i++) {
+        const SDL_Color& color = image->format->palette->colors[i];
+        Uint8* entry = out + 54 + 4 * i;
+        entry[0] = color.b;
+        entry[1] = color.g;
+        entry[2] = color.r;
+    }
+}
+
+void writeBMP(SDL_Surface* image, const BMPEncoding& encoding, Uint8* out) {
+    writeBMPHeader(image, encoding, out);
+    if (encoding.compression == BI_RGB) {
+        size_t rowBytes = (size_t)image->w * image->format->BytesPerPixel;
+        parallelBands(image->h, [image, &encoding, out, rowBytes](int startY, int endY) {
+            for (int y = startY; y < endY; y++) {
+                Uint8* dst = out + encoding.headerSize + (size_t)(image->h - 1 - y) * encoding.stride;
+                memcpy(dst, (Uint8*)image->pixels + (size_t)y * image->pitch, rowBytes);
+                memset(dst + rowBytes, 0, encoding.stride - rowBytes);
+            }
+        });
+    } else {
+        parallelBands(image->h, [image, &encoding, out](int startRow, int endRow) {
+            for (int row = startRow; row < endRow; row++) {
+                memcpy(out + encoding.rleOffsets[row], encoding.rleRows[row].data(), encoding.rleRows[row].size());
+            }
+        });
+        out[encoding.size - 2] = 0;
+        out[encoding.size - 1] = 1;
+    }
+}
+
+#if PYRAMID_LEVELS
+// 2x2 box filter for 4-byte pixels. At exactly half size this is also what a bilinear filter with
+// pixel-centre sampling gives. The SSE2 path widens to 16 bits, adds the two rows vertically and
+// then neighbouring pixels horizontally, two output pixels per step
+void downscaleRow32(const Uint8* a, const Uint8* b, Uint8* dst, int dstWidth) {
+    int x = 0;
+#if PYRAMID_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(2);
+    for (; x + 2 <= dstWidth; x += 2) {
+        __m128i rowA = _mm_loadu_si128((const __m128i*)(a + 8 * x));
+        __m128i rowB = _mm_loadu_si128((const __m128i*)(b + 8 * x));
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(rowA, zero), _mm_unpacklo_epi8(rowB, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(rowA, zero), _mm_unpackhi_epi8(rowB, zero));
+        lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+        hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+        __m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), rounding), 2);
+        _mm_storel_epi64((__m128i*)(dst + 4 * x), _mm_packus_epi16(sum, sum));
+    }
+#endif
+    for (; x < dstWidth; x++) {
+        for (int c = 0; c < 4; c++) {
+            dst[4 * x + c] = (a[8 * x + c] + a[8 * x + 4 + c] + b[8 * x + c] + b[8 * x + 4 + c] + 2) >> 2;
+        }
+    }
+}
+
+// The same filter for 3-byte pixels. Each source pixel pair is loaded as 8 bytes and added to its
+// right-hand neighbour by a 3-lane shift. Two output pixels are packed into one register and stored as
+// 8 bytes, the 2 spare bytes are written again by the next step. Loads stay inside the source rows
+// while x + 3 <= dstWidth
+void downscaleRow24(const Uint8* a, const Uint8* b, Uint8* dst, int dstWidth) {
+    int x = 0;
+#if PYRAMID_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(2);
+    const __m128i firstPixel = _mm_set_epi16(0, 0, 0, 0, 0, -1, -1, -1);
+    for (; x + 3 <= dstWidth; x += 2) {
+        __m128i pair0 = _mm_add_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(a + 6 * x)), zero),
+                                      _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b + 6 * x)), zero));
+        __m128i pair1 = _mm_add_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(a + 6 * x + 6)), zero),
+                                      _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b + 6 * x + 6)), zero));
+        pair0 = _mm_add_epi16(pair0, _mm_srli_si128(pair0, 6));
+        pair1 = _mm_add_epi16(pair1, _mm_srli_si128(pair1, 6));
+        __m128i sum = _mm_or_si128(_mm_and_si128(pair0, firstPixel), _mm_slli_si128(pair1, 6));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+        _mm_storel_epi64((__m128i*)(dst + 3 * x), _mm_packus_epi16(sum, sum));
+    }
+#endif
+    for (; x < dstWidth; x++) {
+        for (int c = 0; c < 3; c++) {
+            dst[3 * x + c] = (a[6 * x + c] + a[6 * x + 3 + c] + b[6 * x + c] + b[6 * x + 3 + c] + 2) >> 2;
+        }
+    }
+}
+
+// Fills rows [startY, endY) of dst from rows 2y and 2y + 1 of src. Palette images can not be averaged,
+// so they keep the top-left pixel of every block
+void downscaleRows(SDL_Surface* src, SDL_Surface* dst, int startY, int endY) {
+    int bytes = src->format->BytesPerPixel;
+    for (int y = startY; y < endY; y++) {
+        const Uint8* a = (const Uint8*)src->pixels + (size_t)(2 * y) * src->pitch;
+        const Uint8* b = a + src->pitch;
+        Uint8* out = (Uint8*)dst->pixels + (size_t)y * dst->pitch;
+        if (bytes == 4) {
+            downscaleRow32(a, b, out, dst->w);
+        } else if (bytes == 3) {
+            downscaleRow24(a, b, out, dst->w);
+        } else if (src->format->palette) {
+            for (int x = 0; x < dst->w; x++) {
+                memcpy(out + x * bytes, a + 2 * x * bytes, bytes);
+            }
+        } else {
+            for (int x = 0; x < dst->w; x++) {
+                for (int c = 0; c < bytes; c++) {
+                    out[x * bytes + c] = (a[2 * x * bytes + c] + a[(2 * x + 1) * bytes + c] + b[2 * x * bytes + c] + b[(2 * x + 1) * bytes + c] + 2) >> 2;
+                }
+            }
+        }
+    }
+}
+#endif
+
+#if WRITE_BEHIND && !defined(_WIN32)
+// Streams finished rows into the output while the workers are still running. Rows are handed out
+// top to bottom, so the writer waits for a contiguous run of finished tiles from the top and writes
+// it with one pwrite (bottom-up BMPs store that run as one contiguous range further up the file),
+// then starts writeback for it with sync_file_range without waiting
+struct WriteBehind {
+    int fd = -1;
+    std::string path;
+    SDL_Surface* image;
+    BMPEncoding encoding;
+    int tiles;
+    std::unique_ptr<std::atomic<bool>[]> tileDone;
+    std::atomic<bool> failed;
+    std::atomic<bool> aborted;
+    std::mutex mutex; // Only for progress, tileDone itself is lock-free
+    std::condition_variable progress; // A tile was finished or the writer is aborted
+    std::thread writer;
+
+    ~WriteBehind();
+};
+
+WriteBehind writeBehind;
+
+bool writeBehindFlush(WriteBehind& wb, int startY, int endY, std::vector<Uint8>& staging) {
+    SDL_Surface* image = wb.image;
+    size_t stride = wb.encoding.stride;
+    size_t rowBytes = (size_t)image->w * image->format->BytesPerPixel;
+    staging.resize((endY - startY) * stride);
+    for (int y = startY; y < endY; y++) {
+        Uint8* dst = staging.data() + (size_t)(endY - 1 - y) * stride;
+        memcpy(dst, (Uint8*)image->pixels + (size_t)y * image->pitch, rowBytes);
+        memset(dst + rowBytes, 0, stride - rowBytes);
+    }
+    off_t offset = wb.encoding.headerSize + (off_t)(image->h - endY) * stride;
+    for (size_t written = 0; written < staging.size();) {
+        ssize_t n = pwrite(wb.fd, staging.data() + written, staging.size() - written, offset + written);
+        if (n <= 0) {
+            return false;
+        }
+        written += n;
+    }
+    sync_file_range(wb.fd, offset, staging.size(), SYNC_FILE_RANGE_WRITE);
+    return true;
+}
+
+bool writeBehindStart(WriteBehind& wb, SDL_Surface* image, const char* path, int tiles) {
+    if ((OUTPUT_RLE && image->format->palette) || !prepareBMP(image, false, wb.encoding)) {
+        return false;
+    }
+    wb.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (wb.fd == -1) {
+        return false;
+    }
+    // Reserve the blocks up front so the streamed writes never have to allocate
+    if (fallocate(wb.fd, 0, 0, wb.encoding.size) != 0 && ftruncate(wb.fd, wb.encoding.size) != 0) {
+        close(wb.fd);
+        wb.fd = -1;
+        return false;
+    }
+    std::vector<Uint8> header(wb.encoding.headerSize);
+    writeBMPHeader(image, wb.encoding, header.data());
+    if (pwrite(wb.fd, header.data(), header.size(), 0) != (ssize_t)header.size()) {
+        close(wb.fd);
+        wb.fd = -1;
+        return false;
+    }
+
+    wb.path = path;
+    wb.image = image;
+    wb.tiles = tiles;
+    wb.tileDone.reset(new std::atomic<bool>[tiles]);
+    for (int i = 0; i < tiles; i++) {
+        wb.tileDone[i].store(false);
+    }
+    wb.failed.store(false);
+    wb.aborted.store(false);
+    wb.writer = std::thread([&wb] {
+        std::vector<Uint8> staging;
+        int flushed = 0, ready = 0;
+        while (flushed < wb.tiles) {
+            {
+                std::unique_lock<std::mutex> lock(wb.mutex);
+                wb.progress.wait(lock, [&wb, flushed, &ready] {
+                    while (ready < wb.tiles && wb.tileDone[ready].load(std::memory_order_acquire)) {
+                        ready++;
+                    }
+                    return wb.aborted.load() || ready == wb.tiles || (ready - flushed) * TILE_ROWS >= WRITE_BEHIND_ROWS;
+                });
+            }
+            if (wb.aborted.load()) {
+                break;
+            }
+            if (!writeBehindFlush(wb, flushed * TILE_ROWS, min(ready * TILE_ROWS, wb.image->h), staging)) {
+                wb.failed.store(true);
+                break;
+            }
+            flushed = ready;
+        }
+    });
+    return true;
+}
+
+void writeBehindTileDone(WriteBehind& wb, int row) {
+    if (wb.fd != -1) {
+        wb.tileDone[row / TILE_ROWS].store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(wb.mutex); // Orders the store against the writer's check, so no wake-up is lost
+        wb.progress.notify_one();
+    }
+}
+
+// Waits for the last rows and makes the file durable, like the msync(MS_SYNC) of the regular path
+// A failed write or flush removes the file, like writeBehindAbort, so no truncated output is left behind
+bool writeBehindFinish(WriteBehind& wb) {
+    wb.writer.join();
+    bool ok = !wb.failed.load() && fdatasync(wb.fd) == 0;
+    close(wb.fd);
+    wb.fd = -1;
+    if (!ok) {
+        unlink(wb.path.c_str());
+    }
+    return ok;
+}
+
+// Stops the writer without waiting for the remaining tiles and removes the partial file
+void writeBehindAbort(WriteBehind& wb) {
+    {
+        std::lock_guard<std::mutex> lock(wb.mutex);
+        wb.aborted.store(true);
+        wb.progress.notify_one();
+    }
+    wb.writer.join();
+    close(wb.fd);
+    wb.fd = -1;
+    unlink(wb.path.c_str());
+}
+
+// Every return of main between writeBehindStart and writeBehindFinish ends up here, a std::thread
+// still joinable when it is destroyed would terminate the process
+WriteBehind::~WriteBehind() {
+    if (writer.joinable()) {
+        writeBehindAbort(*this);
+    }
+}
+#endif
+
+std::atomic<bool> cancelled(false);
+
+void onInterrupt(int) {
+    cancelled.store(true);
+}
+
+// Checked by the workers before every tile, the tile in flight is always finished
+bool jobCancelled(std::chrono::steady_clock::time_point deadline) {
+    if (DEADLINE_MS > 0 && !cancelled.load(std::memory_order_relaxed) && std::chrono::steady_clock::now() >= deadline) {
+        cancelled.store(true);
+    }
+    return cancelled.load(std::memory_order_relaxed);
+}
+
+// Formats the native codec does not handle go through SDL and are copied into the working layout
+SDL_Surface* loadBMPWithSDL(char* data, int size) {
+    SDL_Surface* decoded = SDL_LoadBMP_RW(SDL_RWFromMem(data, size), 1);
+    if (!decoded) {
+        return NULL;
+    }
+    SDL_Surface* aligned = toAlignedRows(decoded);
+    SDL_FreeSurface(decoded);
+    if (!aligned) {
+        SDL_SetError("Unable to allocate working surface");
+    }
+    return aligned;
+}
+
+double medianUs(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+// Decode and encode throughput of the native codec against SDL, in MB of pixel data per second
+int codecBenchmark(const char* path) {
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        std::cerr << "Error: Unable to open file" << std::endl;
+        return 1;
+    }
+    std::vector<Uint8> file;
+    Uint8 chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        file.insert(file.end(), chunk, chunk + n);
+    }
+    fclose(in);
+
+    SDL_Surface* image = loadBMP(file.data(), file.size());
+    if (!image) {
+        std::cerr << "Error: The native codec does not support " << path << std::endl;
+        return 1;
+    }
+    double megabytes = (double)image->w * image->h * image->format->BytesPerPixel / 1e6;
+
+    auto time = [](const std::function<void()>& body) {
+        std::vector<double> samples;
+        for (int i = 0; i < CODEC_ITERATIONS; i++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            body();
+            samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count());
+        }
+        return medianUs(samples);
+    };
+    auto report = [megabytes](const char* name, double us) {
+        printf("%-20s %10.0f us %10.1f MB/s\n", name, us, megabytes / (us / 1e6));
+    };
+
+    report("decode native", time([&file] { freeAlignedRows(loadBMP(file.data(), file.size())); }));
+    report("decode SDL", time([&file] { SDL_FreeSurface(SDL_LoadBMP_RW(SDL_RWFromConstMem(file.data(), file.size()), 1)); }));
+
+    BMPEncoding encoding;
+    prepareBMP(image, false, encoding);
+    std::vector<Uint8> output(encoding.size + 4096); // SDL may write a larger info header
+    report("encode native", time([&] {
+        BMPEncoding e;
+        prepareBMP(image, false, e);
+        writeBMP(image, e, output.data());
+    }));
+    if (image->format->palette) {
+        BMPEncoding rle;
+        prepareBMP(image, true, rle);
+        report("encode native RLE8", time([&] {
+            BMPEncoding e;
+            prepareBMP(image, true, e);
+            writeBMP(image, e, output.data());
+        }));
+        printf("RLE8 output is %zu bytes, uncompressed %zu bytes\n", rle.size, encoding.size);
+    }
+    report("encode SDL", time([&] { SDL_SaveBMP_RW(image, SDL_RWFromMem(output.data(), output.size()), 1); }));
+
+    freeAlignedRows(image);
+    return 0;
+}
+
+// Load throughput (map, decode, unmap) of every input policy, with the file dropped from the page cache before
+// each sample and with it fully cached, in MB of file per second
+int inputBenchmark(const char* path) {
+#ifdef _WIN32
+    std::cerr << "Error: --input-benchmark needs mmap and posix_fadvise" << std::endl;
+    return 1;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        std::cerr << "Error: Unable to open file" << std::endl;
+        return 1;
+    }
+    fdatasync(fd); // Dirty pages cannot be dropped
+    auto setCache = [fd](bool warm) {
+        if (!warm) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            return;
+        }
+        static char chunk[1 << 20];
+        for (off_t offset = 0; pread(fd, chunk, sizeof(chunk), offset) > 0; offset += sizeof(chunk)) {
+        }
+    };
+
+    printf("%-20s %-5s %10s %10s %8s %12s\n", "policy", "cache", "us", "MB/s", "cached", "major faults");
+    bool dropped = true;
+    for (int policy = INPUT_FAULT; policy <= INPUT_AUTO; policy++) {
+        for (int warm = 0; warm < 2; warm++) {
+            std::vector<double> samples;
+            double cached = 0;
+            long faults = 0;
+            InputMapping input;
+            for (int i = 0; i < CODEC_ITERATIONS; i++) {
+                setCache(warm);
+                rusage before, after;
+                getrusage(RUSAGE_SELF, &before);
+                auto start = std::chrono::high_resolution_clock::now();
+                if (!mapInput(path, (InputPolicy)policy, input)) {
+                    std::cerr << "Error: Unable to map file" << std::endl;
+                    close(fd);
+                    return 1;
+                }
+                SDL_Surface* image = loadBMP(input.data, input.size, &input);
+                unmapInput(input);
+                samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count());
+                getrusage(RUSAGE_SELF, &after);
+                if (!image) {
+                    std::cerr << "Error: The native codec does not support " << path << std::endl;
+                    close(fd);
+                    return 1;
+                }
+                freeAlignedRows(image);
+                cached += input.cached / CODEC_ITERATIONS;
+                faults += after.ru_majflt - before.ru_majflt;
+            }
+            dropped = dropped && (warm || cached < 1 - INPUT_WARM);
+            std::string name = INPUT_POLICY_NAMES[policy];
+            if (policy == INPUT_AUTO) {
+                name += std::string(" -> ") + INPUT_POLICY_NAMES[input.policy];
+            }
+            double us = medianUs(samples);
+            printf("%-20s %-5s %10.0f %10.1f %7.0f%% %12ld\n", name.c_str(), warm ? "warm" : "cold", us, input.size / 1e6 / (us / 1e6),
+                100 * cached, faults / CODEC_ITERATIONS);
+        }
+    }
+    if (!dropped) {
+        printf("The page cache kept most of %s, the cold rows are not cold\n", path);
+    }
+    close(fd);
+    return 0;
+#endif
+}
+
 int main(int argc, char* argv[]) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DEADLINE_MS);
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
         return -1;
     }
 
+    if (argc > 1 && strcmp(argv[1], "--codec-benchmark") == 0) {
+        int result = codecBenchmark("image.bmp");
+        SDL_Quit();
+        return result;
+    }
+    if (argc > 1 && strcmp(argv[1], "--input-benchmark") == 0) {
+        int result = inputBenchmark(argc > 2 ? argv[2] : "image.bmp");
+        SDL_Quit();
+        return result;
+    }
+    signal(SIGINT, onInterrupt);
+
+#if PERF_COUNTERS
+    // Inherited, so the decode bands and the write-behind thread land in the load and save rows when they exit.
+    // The process workers are joined between loadEnd and saveBegin and only show up in their own rows
+    PerfCounters mainCounters = perfOpen(true);
+    PerfSample loadBegin = perfRead(mainCounters);
+#endif
+#if TRACE
+    traceInit();
+    traceAttach(0);
+    Uint64 loadStartNs = traceEpochNs;
+#endif
+
 #ifdef _WIN32
     HANDLE hFile = CreateFile(
         L"image.bmp",
@@ -71,7 +1192,10 @@ int main(int argc, char* argv[]) {
     }
 
     int file_size = GetFileSize(hFile, NULL);
-    SDL_Surface* image = SDL_LoadBMP_RW(SDL_RWFromMem(pBuf, file_size), 1);
+    SDL_Surface* image = loadBMP((const Uint8*)pBuf, file_size);
+    if (!image) {
+        image = loadBMPWithSDL(pBuf, file_size);
+    }
 
 
     UnmapViewOfFile(pBuf);
@@ -82,25 +1206,18 @@ int main(int argc, char* argv[]) {
     struct stat sb;
     char* file_data;
 
-    fd = open("image.bmp", O_RDONLY);
-    if (fd == -1) {
+    InputMapping input;
+    if (!mapInput("image.bmp", INPUT_POLICY, input)) {
         std::cerr << "Error: Unable to open file" << std::endl;
         return 1;
     }
-
-    if (fstat(fd, &sb) == -1) {
-        std::cerr << "Error: Unable to get file size" << std::endl;
-        return 1;
-    }
-
-    file_data = static_cast<char*>(mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
-    if (file_data == MAP_FAILED) {
-        std::cerr << "Error: Unable to map file" << std::endl;
-        return 1;
+    SDL_Surface* image = loadBMP(input.data, input.size, &input);
+    if (!image) {
+        image = loadBMPWithSDL((char*)input.data, input.size);
     }
-    SDL_Surface* image = SDL_LoadBMP_RW(SDL_RWFromMem(file_data, sb.st_size), 1);
-    int file_size = sb.st_size;
-    close(fd);
+    int file_size = input.size;
+    unmapInput(input);
+    printf("Input: %s, %.0f%% was cached\n", INPUT_POLICY_NAMES[input.policy], 100 * input.cached);
 #endif
 
     if (!image) {
@@ -108,12 +1225,47 @@ int main(int argc, char* argv[]) {
         SDL_Quit();
         return -1;
     }
+#if PERF_COUNTERS
+    PerfSample loadEnd = perfRead(mainCounters);
+#endif
+#if TRACE
+    traceEvent(TRACE_LOAD, loadStartNs, nowNs());
+    Uint64 processStartNs = nowNs();
+#endif
+    // pyramid[0] is the full resolution image, level k is 1/2^k of it. Levels stop once a dimension would
+    // drop below 1 pixel, every pixel of a level is then built from a full 2x2 block of the one above
+    SDL_Surface* pyramid[PYRAMID_LEVELS + 1] = { image };
+    int levels = 0;
+    while (levels < PYRAMID_LEVELS && image->w >> (levels + 1) > 0 && image->h >> (levels + 1) > 0) {
+        levels++;
+    }
+    if (levels < PYRAMID_LEVELS) {
+        std::cerr << "Warning: The image is too small for " << PYRAMID_LEVELS << " pyramid levels, building " << levels << std::endl;
+    }
+    for (int k = 1; k <= levels; k++) {
+        pyramid[k] = SDL_CreateRGBSurfaceWithFormat(0, image->w >> k, image->h >> k, image->format->BitsPerPixel, image->format->format);
+        if (!pyramid[k]) {
+            std::cerr << "Error: Unable to allocate pyramid level - " << SDL_GetError() << std::endl;
+            SDL_Quit();
+            return -1;
+        }
+        if (image->format->palette) {
+            SDL_SetSurfacePalette(pyramid[k], image->format->palette);
+        }
+    }
+
     auto startTime = std::chrono::high_resolution_clock::now();
 
-    std::queue<int> rowsToProcess;
-    for (int i = 0; i < image->h; i++) {
+    int tiles = (image->h + TILE_ROWS - 1) / TILE_ROWS;
+    std::queue<int> rowsToProcess; // First row of every tile
+    for (int i = 0; i < image->h; i += TILE_ROWS) {
         rowsToProcess.push(i);
     }
+#if WRITE_BEHIND && !defined(_WIN32)
+    bool streamed = writeBehindStart(writeBehind, image, "output.bmp", tiles);
+#else
+    bool streamed = false;
+#endif
     int currentlyWorking = 0;
 #ifdef _WIN32
     HANDLE queueMutex = CreateMutex(
@@ -131,17 +1283,37 @@ int main(int argc, char* argv[]) {
     std::vector<std::thread> threads;
 
     for (int i = 0; i < THREADS; ++i) {
-        threads.emplace_back([&rowsToProcess, &image, &queueMutex, &currentlyWorking] {
+        threads.emplace_back([i, &rowsToProcess, &image, &pyramid, levels, &queueMutex, &currentlyWorking, deadline] {
 #if _WIN32
             SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
 #else
             pthread_setschedparam(pthread_self(), SCHED_BATCH, new sched_param{ sched_priority: 20 });
+#endif
+#if PERF_COUNTERS
+            PerfCounters counters = perfOpen();
+            PerfSample begin = perfRead(counters);
+#endif
+#if TRACE
+            traceAttach(i + 1);
+            Uint64 idleStartNs = 0;
+#endif
+#if PERF_COUNTERS || TRACE
+            Uint64 lockWaitStartNs = 0;
 #endif
             while (true) {
+                if (jobCancelled(deadline)) {
+                    break;
+                }
+#if PERF_COUNTERS || TRACE
+                lockWaitStartNs = nowNs();
+#endif
 #ifdef _WIN32
                 WaitForSingleObject(queueMutex, INFINITE);
 #else
                 pthread_mutex_lock(&queueMutex);
+#endif
+#if PERF_COUNTERS || TRACE
+                recordLockWait(lockWaitStartNs);
 #endif
                 bool empty = rowsToProcess.empty();
                 int row = -1;
@@ -156,18 +1328,50 @@ int main(int argc, char* argv[]) {
                 pthread_mutex_unlock(&queueMutex);
 #endif
 
+#if TRACE
+                // Consecutive spins while MAX_WORKERS rows are in flight are merged into one idle event
+                if (row == -1 && !empty && idleStartNs == 0) {
+                    idleStartNs = lockWaitStartNs;
+                }
+                if ((row != -1 || empty) && idleStartNs != 0) {
+                    traceEvent(TRACE_IDLE, idleStartNs, lockWaitStartNs);
+                    idleStartNs = 0;
+                }
+#endif
+
                 if (empty) {
                     break;
                 }
                 if (row == -1) {
                     continue;
                 }
-                decreaseContrast(image, row, row + 1, CONTRAST_FACTOR);
+#if TRACE
+                Uint64 rowStartNs = nowNs();
+#endif
+                decreaseContrast(image, row, min(row + TILE_ROWS, image->h), CONTRAST_FACTOR);
+#if PYRAMID_LEVELS
+                // The tile is still in cache, every level only reads the rows the previous level just wrote
+                for (int k = 1; k <= levels; k++) {
+                    downscaleRows(pyramid[k - 1], pyramid[k], row >> k, min((row + TILE_ROWS) >> k, pyramid[k]->h));
+                }
+#endif
+#if TRACE
+                traceEvent(TRACE_ROW, rowStartNs, nowNs(), row);
+#endif
+#if WRITE_BEHIND && !defined(_WIN32)
+                writeBehindTileDone(writeBehind, row);
+#endif
 
+#if PERF_COUNTERS || TRACE
+                lockWaitStartNs = nowNs();
+#endif
 #ifdef _WIN32
                 WaitForSingleObject(queueMutex, INFINITE);
 #else
                 pthread_mutex_lock(&queueMutex);
+#endif
+#if PERF_COUNTERS || TRACE
+                recordLockWait(lockWaitStartNs);
 #endif
                 currentlyWorking--;
 #ifdef _WIN32
@@ -176,11 +1380,17 @@ int main(int argc, char* argv[]) {
                 pthread_mutex_unlock(&queueMutex);
 #endif
             }
+#if PERF_COUNTERS
+            PerfSample end = perfRead(counters);
+            end.mutexWaitNs = perfMutexWaitNs;
+            perfThreadSamples[i] = perfDelta(begin, end);
+            perfClose(counters);
+#endif
             });
     }
 
     std::atomic_bool done;
-    std::thread progressBar([&done, &rowsToProcess, &queueMutex, &image] {
+    std::thread progressBar([&done, &rowsToProcess, &queueMutex, tiles] {
         while (true) {
 #ifdef _WIN32
             WaitForSingleObject(queueMutex, INFINITE);
@@ -193,7 +1403,7 @@ int main(int argc, char* argv[]) {
 #else
             pthread_mutex_unlock(&queueMutex);
 #endif
-            printf("\u001b[2K\u001b[0G%.2f%%", 100 * (1 - (double)left / image->h));
+            printf("\u001b[2K\u001b[0G%.2f%%", 100 * (1 - (double)left / tiles));
             if (done.load()) {
                 std::cout << "\u001b[2K\u001b[0G";
                 break;
@@ -211,6 +1421,9 @@ int main(int argc, char* argv[]) {
     }
 
     auto endTime = std::chrono::high_resolution_clock::now();
+#if TRACE
+    traceEvent(TRACE_PROCESS, processStartNs, nowNs());
+#endif
 
     done.store(true);
     progressBar.join();
@@ -223,7 +1436,35 @@ int main(int argc, char* argv[]) {
 
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
 
-    printf("Time taken: %d microseconds\n", duration.count());
+    printf("Time taken: %lld microseconds\n", (long long)duration.count());
+
+    if (cancelled.load()) {
+        std::cerr << "Cancelled, " << rowsToProcess.size() << " of " << tiles << " tiles not processed" << std::endl;
+#if WRITE_BEHIND && !defined(_WIN32)
+        if (streamed) {
+            writeBehindAbort(writeBehind);
+        }
+#endif
+        for (int k = 1; k <= levels; k++) {
+            SDL_FreeSurface(pyramid[k]);
+        }
+        freeAlignedRows(image);
+        SDL_Quit();
+        return 1;
+    }
+
+#if PERF_COUNTERS
+    PerfSample saveBegin = perfRead(mainCounters);
+#endif
+#if TRACE
+    Uint64 saveStartNs = nowNs();
+#endif
+
+    BMPEncoding encoding;
+    bool nativeSave = prepareBMP(image, OUTPUT_RLE, encoding);
+    if (nativeSave) {
+        file_size = encoding.size;
+    }
 
 #ifdef _WIN32
     hFile = CreateFile(L"output.bmp", GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -251,40 +1492,106 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    SDL_SaveBMP_RW(image, SDL_RWFromMem(pBuf, file_size), 1);
+    if (nativeSave) {
+        writeBMP(image, encoding, (Uint8*)pBuf);
+    } else {
+        SDL_SaveBMP_RW(image, SDL_RWFromMem(pBuf, file_size), 1);
+    }
 
     UnmapViewOfFile(pBuf);
     CloseHandle(hMap);
     CloseHandle(hFile);
 #else
-    fd = open("output.bmp", O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (fd == -1) {
-        std::cerr << "Error: Unable to open file" << std::endl;
+#if WRITE_BEHIND
+    if (streamed && !writeBehindFinish(writeBehind)) {
+        std::cerr << "Error: Unable to write file" << std::endl;
+        for (int k = 1; k <= levels; k++) {
+            SDL_FreeSurface(pyramid[k]);
+        }
+        freeAlignedRows(image);
+        SDL_Quit();
         return 1;
     }
+#endif
+    if (!streamed) {
+        fd = open("output.bmp", O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            std::cerr << "Error: Unable to open file" << std::endl;
+            return 1;
+        }
 
-    ftruncate(fd, file_size);
+        ftruncate(fd, file_size);
 
-    if (fstat(fd, &sb) == -1) {
-        std::cerr << "Error: Unable to get file size" << std::endl;
-        return 1;
+        if (fstat(fd, &sb) == -1) {
+            std::cerr << "Error: Unable to get file size" << std::endl;
+            return 1;
+        }
+
+        file_data = static_cast<char*>(mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        if (file_data == MAP_FAILED) {
+            std::cerr << "Error: Unable to map file" << std::endl;
+            return 1;
+        }
+        if (nativeSave) {
+            writeBMP(image, encoding, (Uint8*)file_data);
+        } else {
+            SDL_SaveBMP_RW(image, SDL_RWFromMem(file_data, sb.st_size), 1);
+        }
+        if (msync(file_data, sb.st_size, MS_SYNC) == -1) {
+            std::cerr << "Error: Unable to sync file" << std::endl;
+            return 1;
+        }
+        munmap(file_data, sb.st_size);
+        close(fd);
     }
+#endif
 
-    file_data = static_cast<char*>(mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
-    if (file_data == MAP_FAILED) {
-        std::cerr << "Error: Unable to map file" << std::endl;
-        return 1;
+    auto savedTime = std::chrono::high_resolution_clock::now();
+    printf("Time to output on disk: %lld microseconds%s\n",
+           (long long)std::chrono::duration_cast<std::chrono::microseconds>(savedTime - startTime).count(), streamed ? " (write-behind)" : "");
+
+#if PERF_COUNTERS
+    PerfSample saveEnd = perfRead(mainCounters); // Before traceWrite, writing trace.json is not part of the save
+#endif
+
+#if TRACE
+    traceEvent(TRACE_SAVE, saveStartNs, nowNs());
+    traceWrite("trace.json");
+#endif
+
+#if PERF_COUNTERS
+    perfClose(mainCounters);
+
+    PerfSample process = {};
+    for (int i = 0; i < THREADS; i++) {
+        perfAccumulate(process, perfThreadSamples[i]);
     }
-    SDL_SaveBMP_RW(image, SDL_RWFromMem(file_data, sb.st_size), 1);
-    if (msync(file_data, sb.st_size, MS_SYNC) == -1) {
-        std::cerr << "Error: Unable to sync file" << std::endl;
-        return 1;
+
+    printf("\nPerf counters per phase (process is the sum over workers):\n");
+    perfPrintHeader();
+    perfPrintRow("load", perfDelta(loadBegin, loadEnd));
+    perfPrintRow("process", process);
+    perfPrintRow("save", perfDelta(saveBegin, saveEnd));
+
+    printf("\nPerf counters per worker thread:\n");
+    perfPrintHeader();
+    for (int i = 0; i < THREADS; i++) {
+        std::string name = "thread " + std::to_string(i);
+        perfPrintRow(name.c_str(), perfThreadSamples[i]);
+    }
+#endif
+
+#if PYRAMID_LEVELS
+    for (int k = 1; k <= levels; k++) {
+        std::string name = "output-1-" + std::to_string(1 << k) + ".bmp";
+        if (SDL_SaveBMP(pyramid[k], name.c_str()) != 0) {
+            std::cerr << "Error: Unable to save " << name << " - " << SDL_GetError() << std::endl;
+        }
+        SDL_FreeSurface(pyramid[k]);
     }
-    munmap(file_data, sb.st_size);
-    close(fd);
 #endif
 
-    SDL_FreeSurface(image);
+    freeAlignedRows(image);
     SDL_Quit();
     return 0;
 }